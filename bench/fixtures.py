@@ -0,0 +1,86 @@
+"""Regenerates the checked-in benchmark fixtures: ``python -m bench.fixtures``"""
+from __future__ import annotations
+
+import random
+import pathlib
+
+from PIL import Image, ImageDraw
+
+FIXTURE_DIR = pathlib.Path(__file__).parent / 'fixtures'
+
+# name -> (width, height), the salt kernels see them resized like the routes do
+SIZES = {
+    'small': (160, 80),
+    'medium': (128, 128),
+    'large': (200, 600),
+}
+
+
+def draw_fixture(size: tuple[int, int], seed: int = 1234) -> Image.Image:
+    """A transparent background with overlapping shapes in many colors, like a typical sticker/avatar."""
+    rng = random.Random(seed)
+    w, h = size
+    im = Image.new('RGBA', size, (0, 0, 0, 0))
+    draw = ImageDraw.Draw(im)
+    draw.ellipse((w // 10, h // 10, w - w // 10, h - h // 10), fill=(230, 180, 60, 255))
+    for _ in range(12):
+        x, y = rng.randrange(w), rng.randrange(h)
+        r = rng.randrange(max(2, w // 10), max(3, w // 4))
+        color = (rng.randrange(256), rng.randrange(256), rng.randrange(256), rng.choice((255, 255, 200)))
+        if rng.random() < 0.5:
+            draw.ellipse((x - r, y - r, x + r, y + r), fill=color)
+        else:
+            draw.rectangle((x - r, y - r // 2, x + r, y + r // 2), fill=color)
+    # soft gradient so there are more than a handful of distinct colors
+    for y in range(h):
+        for x in range(0, w, 3):
+            pixel = im.getpixel((x, y))
+            if pixel[3]:  # type: ignore
+                im.putpixel((x, y), (pixel[0], (pixel[1] + y) % 256, pixel[2], pixel[3]))  # type: ignore
+    return im
+
+
+def draw_animation(size: tuple[int, int], frames: int = 12) -> list[Image.Image]:
+    base = draw_fixture(size)
+    return [base.rotate(i * 360 / frames) for i in range(frames)]
+
+
+def fixture_paths() -> dict[str, pathlib.Path]:
+    """The PNG fixtures of every size, what the native benchmark runs on."""
+    return {name: FIXTURE_DIR / f'{name}.png' for name in SIZES}
+
+
+# the load test's images, one per format the API accepts
+FORMAT_FIXTURES = {
+    'png': 'medium.png',
+    'gif': 'animated.gif',
+    'jpeg': 'photo.jpg',
+    'webp': 'sticker.webp',
+}
+
+
+def format_paths() -> dict[str, pathlib.Path]:
+    return {fmt: FIXTURE_DIR / name for fmt, name in FORMAT_FIXTURES.items()}
+
+
+def main():
+    FIXTURE_DIR.mkdir(exist_ok=True)
+    for name, path in fixture_paths().items():
+        draw_fixture(SIZES[name]).save(path, format='png', optimize=True)
+        print(f'wrote {path}')
+
+    paths = format_paths()
+    frames = draw_animation((160, 160))
+    frames[0].save(paths['gif'], format='gif', save_all=True, append_images=frames[1:], duration=60, loop=0, disposal=2)
+    # no alpha in JPEG, a white background like a photo
+    photo = Image.new('RGB', (640, 480), (255, 255, 255))
+    sticker = draw_fixture((640, 480))
+    photo.paste(sticker, mask=sticker)
+    photo.save(paths['jpeg'], format='jpeg', quality=85)
+    draw_fixture((256, 256)).save(paths['webp'], format='webp', quality=80)
+    for fmt in ('gif', 'jpeg', 'webp'):
+        print(f'wrote {paths[fmt]}')
+
+
+if __name__ == '__main__':
+    main()
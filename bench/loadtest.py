@@ -0,0 +1,421 @@
+"""End to end load test.
+
+    python -m bench.loadtest                                  # 2 workers, 8 clients, 30s
+    python -m bench.loadtest -w 4 -c 32 -d 60 -o load.json
+    python -m bench.loadtest --mix particles=1,replace_colors=1 --process-workers 2
+
+Starts ``gunicorn main:app -c gunicorn_pref.py`` on a free port with rate limiting
+off, and a local HTTP server that serves the fixture PNG/GIF/JPEG/WebP images, so
+``get_image_url`` never leaves the machine. ``-c`` clients send requests back to
+back, each picks an endpoint from the weighted mix and an image format in turn.
+
+Reports throughput, latency percentiles overall and per endpoint, responses by
+status, and the peak RSS of the gunicorn master and every worker.
+"""
+from __future__ import annotations
+from typing import Any, Optional
+
+import os
+import sys
+import json
+import time
+import random
+import signal
+import socket
+import asyncio
+import argparse
+import pathlib
+import threading
+import subprocess
+from http.server import ThreadingHTTPServer, SimpleHTTPRequestHandler
+
+import aiohttp
+
+from .fixtures import format_paths
+
+ROOT = pathlib.Path(__file__).parent.parent
+
+# endpoint -> json body, image_url is filled in per request
+ENDPOINTS: dict[str, dict[str, Any]] = {
+    'particles': {'particle_type': 0, 'speed': 2, 'amount': 8},
+    'explode': {'percent': 80},
+    'dust': {},
+    'sand': {},
+    'replace_colors': {'colors': [[255, 0, 0], [0, 255, 0], [0, 0, 255]], 'max_distance': 16.0},
+    'merge_colors': {'num_colors': 16},
+    'runescape': {'text': 'wave2:glow1:selling lobbies 500gp ea'},
+}
+
+DEFAULT_MIX = 'particles=3,explode=2,dust=1,sand=1,replace_colors=2,runescape=1'
+
+PERCENTILES = (50, 90, 99)
+
+
+def _free_port() -> int:
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def parse_mix(mix: str) -> dict[str, int]:
+    weights = {}
+    for part in mix.split(','):
+        name, _, weight = part.partition('=')
+        if name not in ENDPOINTS:
+            raise SystemExit(f'unknown endpoint {name!r}, one of {", ".join(ENDPOINTS)}')
+        weights[name] = int(weight or 1)
+    return weights
+
+
+class _FixtureHandler(SimpleHTTPRequestHandler):
+    extensions_map = {
+        '.png': 'image/png',
+        '.gif': 'image/gif',
+        '.jpg': 'image/jpeg',
+        '.webp': 'image/webp',
+        '': 'application/octet-stream',
+    }
+
+    def log_message(self, format, *args):
+        pass
+
+
+class ImageServer:
+    """Serves bench/fixtures on a background thread, standing in for the image host."""
+
+    def __init__(self):
+        directory = str(next(iter(format_paths().values())).parent)
+        handler = lambda *args, **kwargs: _FixtureHandler(*args, directory=directory, **kwargs)
+        self.server = ThreadingHTTPServer(('127.0.0.1', 0), handler)
+        self.thread = threading.Thread(target=self.server.serve_forever, daemon=True)
+
+    def urls(self) -> dict[str, str]:
+        host, port = self.server.server_address[:2]
+        return {fmt: f'http://{host}:{port}/{path.name}' for fmt, path in format_paths().items()}
+
+    def __enter__(self) -> ImageServer:
+        self.thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.server.shutdown()
+        self.server.server_close()
+
+
+class Server:
+    """The API under gunicorn, in its own process group so the workers go down with it."""
+
+    def __init__(self, workers: int, process_workers: int, log: Optional[str]):
+        self.port = _free_port()
+        self.url = f'http://127.0.0.1:{self.port}'
+        self.workers = workers
+        self.env = {
+            **os.environ,
+            'ZNEITIZ_RATE_LIMIT': '0',
+            'ZNEITIZ_PROCESS_WORKERS': str(process_workers),
+        }
+        self.log = log
+        self.proc: Optional[subprocess.Popen] = None
+
+    def start(self, timeout: float = 60.0):
+        out = open(self.log, 'w') if self.log else subprocess.DEVNULL
+        self.proc = subprocess.Popen(
+            [
+                sys.executable, '-m', 'gunicorn', 'main:app',
+                '-c', 'gunicorn_pref.py',
+                '--bind', f'127.0.0.1:{self.port}',
+                '--workers', str(self.workers),
+            ],
+            cwd=ROOT,
+            env=self.env,
+            stdout=out,
+            stderr=subprocess.STDOUT,
+            start_new_session=True,
+        )
+        # every worker has to be up, not just the first one to accept
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            if self.proc.poll() is not None:
+                raise RuntimeError(f'gunicorn exited with {self.proc.returncode}, see --server-log')
+            try:
+                with socket.create_connection(('127.0.0.1', self.port), timeout=1):
+                    pass
+            except OSError:
+                time.sleep(0.2)
+                continue
+            if len(self.worker_pids()) >= self.workers:
+                return
+            time.sleep(0.2)
+        self.stop()
+        raise RuntimeError('gunicorn did not start in time')
+
+    def worker_pids(self) -> list[int]:
+        assert self.proc is not None
+        return _children(self.proc.pid)
+
+    def stop(self):
+        if self.proc is not None and self.proc.poll() is None:
+            os.killpg(self.proc.pid, signal.SIGTERM)
+            try:
+                self.proc.wait(30)
+            except subprocess.TimeoutExpired:
+                os.killpg(self.proc.pid, signal.SIGKILL)
+                self.proc.wait()
+
+
+def _children(pid: int) -> list[int]:
+    try:
+        with open(f'/proc/{pid}/task/{pid}/children') as f:
+            return [int(p) for p in f.read().split()]
+    except OSError:
+        return []
+
+
+def _descendants(pid: int) -> list[int]:
+    # the process pool's workers are children of the forkserver, not of the gunicorn worker
+    found = []
+    for child in _children(pid):
+        found.append(child)
+        found.extend(_descendants(child))
+    return found
+
+
+def _rss_kb(pid: int) -> int:
+    try:
+        with open(f'/proc/{pid}/status') as f:
+            for line in f:
+                if line.startswith('VmRSS:'):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+class RSSSampler:
+    """Peak RSS of the master and every worker, a worker's descendants (the process
+    pool) are counted in with it. Linux only, records nothing elsewhere."""
+
+    def __init__(self, server: Server, interval: float = 0.5):
+        self.server = server
+        self.interval = interval
+        self.peak: dict[str, int] = {}
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+
+    def sample(self):
+        assert self.server.proc is not None
+        master = self.server.proc.pid
+        values = {'master': _rss_kb(master)}
+        for pid in self.server.worker_pids():
+            values[f'worker-{pid}'] = _rss_kb(pid) + sum(_rss_kb(c) for c in _descendants(pid))
+        for name, kb in values.items():
+            self.peak[name] = max(self.peak.get(name, 0), kb)
+
+    def _run(self):
+        while not self._stop.wait(self.interval):
+            self.sample()
+
+    def __enter__(self) -> RSSSampler:
+        self.sample()
+        self._thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self._stop.set()
+        self._thread.join()
+        self.sample()
+
+
+class Recorder:
+    def __init__(self):
+        # endpoint -> [(seconds, status)], status 0 is a connection error or timeout
+        self.samples: dict[str, list[tuple[float, int]]] = {}
+
+    def add(self, endpoint: str, seconds: float, status: int):
+        self.samples.setdefault(endpoint, []).append((seconds, status))
+
+    @staticmethod
+    def _summary(samples: list[tuple[float, int]], duration: float) -> dict[str, Any]:
+        latencies = sorted(s for s, status in samples if status == 200)
+        statuses: dict[str, int] = {}
+        for _, status in samples:
+            statuses[str(status)] = statuses.get(str(status), 0) + 1
+        ok = len(latencies)
+        summary = {
+            'requests': len(samples),
+            'ok': ok,
+            'error_rate': (len(samples) - ok) / len(samples) if samples else 0.0,
+            'throughput': ok / duration if duration else 0.0,
+            'statuses': statuses,
+        }
+        for p in PERCENTILES:
+            # nearest rank, latency of successful requests only
+            summary[f'p{p}_ms'] = latencies[max(0, -(-p * ok // 100) - 1)] * 1000 if ok else None
+        summary['max_ms'] = latencies[-1] * 1000 if ok else None
+        return summary
+
+    def report(self, duration: float) -> dict[str, Any]:
+        everything = [s for samples in self.samples.values() for s in samples]
+        return {
+            'overall': self._summary(everything, duration),
+            'endpoints': {name: self._summary(samples, duration) for name, samples in sorted(self.samples.items())},
+        }
+
+
+async def _client(
+    session: aiohttp.ClientSession,
+    base: str,
+    urls: list[str],
+    mix: dict[str, int],
+    deadline: float,
+    recorder: Recorder,
+    rng: random.Random,
+    timeout: float,
+):
+    names = list(mix)
+    weights = list(mix.values())
+    i = rng.randrange(len(urls))
+    while time.monotonic() < deadline:
+        endpoint = rng.choices(names, weights)[0]
+        body = dict(ENDPOINTS[endpoint])
+        if endpoint == 'merge_colors':
+            body['source_url'] = urls[i % len(urls)]
+            body['destination_url'] = urls[(i + 1) % len(urls)]
+        elif endpoint != 'runescape':
+            body['image_url'] = urls[i % len(urls)]
+        i += 1
+
+        start = time.perf_counter()
+        try:
+            async with session.post(
+                f'{base}/image/{endpoint}', json=body, timeout=aiohttp.ClientTimeout(total=timeout)
+            ) as resp:
+                await resp.read()
+                status = resp.status
+        except (aiohttp.ClientError, asyncio.TimeoutError):
+            status = 0
+        recorder.add(endpoint, time.perf_counter() - start, status)
+
+
+async def drive(
+    base: str,
+    urls: list[str],
+    mix: dict[str, int],
+    *,
+    concurrency: int,
+    duration: float,
+    seed: int,
+    timeout: float,
+) -> tuple[Recorder, float]:
+    recorder = Recorder()
+    connector = aiohttp.TCPConnector(limit=concurrency)
+    async with aiohttp.ClientSession(connector=connector) as session:
+        start = time.monotonic()
+        deadline = start + duration
+        await asyncio.gather(*(
+            _client(session, base, urls, mix, deadline, recorder, random.Random(seed + n), timeout)
+            for n in range(concurrency)
+        ))
+        elapsed = time.monotonic() - start
+    return recorder, elapsed
+
+
+def run(
+    *,
+    workers: int = 2,
+    concurrency: int = 8,
+    duration: float = 30.0,
+    warmup: float = 3.0,
+    mix: Optional[dict[str, int]] = None,
+    formats: tuple[str, ...] = ('png', 'gif', 'jpeg', 'webp'),
+    process_workers: int = 0,
+    seed: int = 1234,
+    timeout: float = 60.0,
+    server_log: Optional[str] = None,
+) -> dict[str, Any]:
+    mix = mix or parse_mix(DEFAULT_MIX)
+    server = Server(workers, process_workers, server_log)
+    with ImageServer() as images:
+        all_urls = images.urls()
+        urls = [all_urls[fmt] for fmt in formats]
+        server.start()
+        try:
+            if warmup > 0:
+                asyncio.run(drive(server.url, urls, mix, concurrency=concurrency, duration=warmup, seed=seed, timeout=timeout))
+            with RSSSampler(server) as rss:
+                recorder, elapsed = asyncio.run(
+                    drive(server.url, urls, mix, concurrency=concurrency, duration=duration, seed=seed, timeout=timeout)
+                )
+        finally:
+            server.stop()
+
+    return {
+        'config': {
+            'workers': workers,
+            'process_workers': process_workers,
+            'concurrency': concurrency,
+            'duration': elapsed,
+            'mix': mix,
+            'formats': list(formats),
+            'cpus': os.cpu_count(),
+        },
+        **recorder.report(elapsed),
+        'peak_rss_kb': rss.peak,
+    }
+
+
+def _ms(value: Optional[float]) -> str:
+    return f'{value:9.1f}' if value is not None else f'{"-":>9}'
+
+
+def print_report(results: dict[str, Any]):
+    rows = [('overall', results['overall']), *results['endpoints'].items()]
+    print(f"{'endpoint':<15} {'reqs':>6} {'req/s':>8} {'errors':>7} {'p50 ms':>9} {'p90 ms':>9} {'p99 ms':>9}  statuses")
+    for name, s in rows:
+        statuses = ' '.join(f'{k}:{v}' for k, v in sorted(s['statuses'].items()))
+        print(
+            f"{name:<15} {s['requests']:>6} {s['throughput']:>8.2f} {s['error_rate']:>6.1%} "
+            f"{_ms(s['p50_ms'])} {_ms(s['p90_ms'])} {_ms(s['p99_ms'])}  {statuses}"
+        )
+    print()
+    for name, kb in sorted(results['peak_rss_kb'].items()):
+        print(f'{name:<15} peak rss {kb / 1024:8.1f} MiB')
+
+
+def main(argv: Optional[list[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-w', '--workers', type=int, default=2, help='gunicorn workers')
+    parser.add_argument('-c', '--concurrency', type=int, default=8, help='requests in flight')
+    parser.add_argument('-d', '--duration', type=float, default=30.0, help='seconds to measure')
+    parser.add_argument('--warmup', type=float, default=3.0, help='seconds of load before measuring')
+    parser.add_argument('-m', '--mix', default=DEFAULT_MIX, help='endpoint=weight,... from: ' + ', '.join(ENDPOINTS))
+    parser.add_argument('-f', '--formats', default='png,gif,jpeg,webp', help='fixture formats to cycle through')
+    parser.add_argument('--process-workers', type=int, default=0, help='ZNEITIZ_PROCESS_WORKERS of every worker')
+    parser.add_argument('-s', '--seed', type=int, default=1234)
+    parser.add_argument('--timeout', type=float, default=60.0, help='per request timeout')
+    parser.add_argument('--server-log', help='write gunicorn output here')
+    parser.add_argument('-o', '--output', help='write the results as JSON here')
+    args = parser.parse_args(argv)
+
+    results = run(
+        workers=args.workers,
+        concurrency=args.concurrency,
+        duration=args.duration,
+        warmup=args.warmup,
+        mix=parse_mix(args.mix),
+        formats=tuple(args.formats.split(',')),
+        process_workers=args.process_workers,
+        seed=args.seed,
+        timeout=args.timeout,
+        server_log=args.server_log,
+    )
+    print_report(results)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2)
+    # nothing succeeded, the server is broken rather than slow
+    return 0 if results['overall']['ok'] else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,229 @@
+"""Native kernel benchmark.
+
+    python -m bench.native                       # build, run, print a table
+    python -m bench.native -o baseline.json      # save the results
+    python -m bench.native --compare baseline.json
+    python -m bench.native --sweep               # check the fast CIEDE2000 error bound
+
+The kernels run in ``native_bench`` (bench/native_bench.c), compiled from the same
+sources and with the same compiler flags as the cffi extensions. Every case runs in
+its own process so peak RSS is per case. With ``--compare`` the exit status is 1 if
+any case got slower than the threshold, with ``--sweep`` if color_distance2000_fast is
+further off than color_distance2000_fast_error (routes/src/colors/color_replace.h).
+"""
+from __future__ import annotations
+from typing import Any, Optional
+
+import os
+import sys
+import json
+import shlex
+import struct
+import argparse
+import pathlib
+import platform
+import sysconfig
+import subprocess
+import tempfile
+
+from PIL import Image
+
+from cffi_make import PROFILES
+from routes.utils.img_utils import fit_size, decode_rgba
+
+from .fixtures import fixture_paths
+
+ROOT = pathlib.Path(__file__).parent.parent
+BUILD_DIR = pathlib.Path(__file__).parent / 'build'
+
+SALT_SOURCES = ['c_particles.c', 'dust.c', 'salt.c']
+COLORS_SOURCES = ['color_replace.c']
+
+DISTANCE_KERNELS = ('distance', 'distance76', 'distance94', 'distance2000fast')
+KERNELS = ('particles0', 'particles1', 'particles2', 'particles3', 'debris', 'crumble', 'dust', 'dustclosed', 'replace', *DISTANCE_KERNELS)
+
+# what ns_per_op is per, for the report
+KERNEL_UNITS = {'replace': 'distance', **{kernel: 'distance' for kernel in DISTANCE_KERNELS}}
+
+
+def _geometry(kernel: str, size: tuple[int, int]) -> tuple[int, int]:
+    # the size the routes resize to before running the kernel
+    if kernel.startswith(('particles', 'dust')) or kernel == 'crumble':
+        return fit_size(size, width=128, max_size=600)
+    if kernel == 'debris':
+        return fit_size(size, width=80)
+    return size
+
+
+def _padding(kernel: str, width: int, height: int) -> tuple[int, int, int, int]:
+    # (top, right, bottom, left), the same the routes use
+    if kernel.startswith('particles'):
+        return 36, 0, 0, 0
+    if kernel == 'debris':
+        return 40, 20, 0, 20
+    if kernel.startswith('dust'):
+        return height//5, width//4, height//5, width//10
+    if kernel == 'crumble':
+        return 0, height//3, height//4, height//3
+    return 0, 0, 0, 0
+
+
+def compiler_command(output: pathlib.Path, extra_flags: Optional[list[str]] = None) -> list[str]:
+    cc = shlex.split(sysconfig.get_config_var('CC') or 'cc')
+    cflags = shlex.split(sysconfig.get_config_var('CFLAGS') or '-O2')
+    salt = ROOT / 'routes/src/salt'
+    colors = ROOT / 'routes/src/colors'
+    common = ROOT / 'routes/src/common'
+    return [
+        *cc,
+        *cflags,
+        # same as the extensions, see routes/src/common/isa.h
+        '-ffp-contract=off',
+        *(extra_flags or []),
+        f'-I{salt}',
+        f'-I{colors}',
+        f'-I{common}',
+        str(pathlib.Path(__file__).parent / 'native_bench.c'),
+        *(str(salt / s) for s in SALT_SOURCES),
+        *(str(colors / s) for s in COLORS_SOURCES),
+        '-lm',
+        '-o',
+        str(output),
+    ]
+
+
+def build(extra_flags: Optional[list[str]] = None, name: str = 'native_bench') -> pathlib.Path:
+    BUILD_DIR.mkdir(exist_ok=True)
+    output = BUILD_DIR / name
+    proc = subprocess.run(compiler_command(output, extra_flags), capture_output=True, text=True)
+    if proc.returncode:
+        print(proc.stderr, file=sys.stderr)
+        proc.check_returncode()
+    return output
+
+
+def write_fixture(path: pathlib.Path, kernel: str, directory: pathlib.Path) -> pathlib.Path:
+    with Image.open(path) as im:
+        w, h = _geometry(kernel, im.size)
+        arr = decode_rgba(im, (w, h), pad=_padding(kernel, w, h))
+
+    out = directory / f'{path.stem}-{kernel}.rgba'
+    with open(out, 'wb') as f:
+        f.write(b'RGBA')
+        f.write(struct.pack('=II', arr.shape[1], arr.shape[0]))
+        f.write(arr.tobytes())
+    return out
+
+
+def run(
+    binary: pathlib.Path,
+    *,
+    kernels: tuple[str, ...] = KERNELS,
+    seed: int = 1234,
+    repeat: int = 5,
+    quiet: bool = False,
+) -> dict[str, Any]:
+    cases = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for kernel in kernels:
+            # distances don't use an image
+            fixtures = {'none': None} if kernel in DISTANCE_KERNELS else fixture_paths()
+            for fixture, path in fixtures.items():
+                raw = write_fixture(path, kernel, pathlib.Path(tmp)) if path else pathlib.Path(os.devnull)
+                proc = subprocess.run(
+                    [str(binary), kernel, str(raw), str(seed), str(repeat)],
+                    check=True,
+                    capture_output=True,
+                    text=True,
+                )
+                case = json.loads(proc.stdout)
+                case['fixture'] = fixture
+                case['unit'] = KERNEL_UNITS.get(kernel, 'update')
+                cases.append(case)
+                if not quiet:
+                    print(_format_case(case), file=sys.stderr)
+
+    return {
+        'machine': {
+            'platform': platform.platform(),
+            'processor': platform.processor() or platform.machine(),
+            'cpus': os.cpu_count(),
+            'isa': cases[0]['isa'] if cases else None,
+        },
+        'seed': seed,
+        'repeat': repeat,
+        'cases': cases,
+    }
+
+
+def _format_case(case: dict[str, Any]) -> str:
+    return (
+        f"{case['kernel']:<11} {case['fixture']:<7} {case['width']:>4}x{case['height']:<4} "
+        f"{case['best_seconds'] * 1000:9.2f} ms  {case['ns_per_op']:8.2f} ns/{case['unit']:<8} "
+        f"{case['frames_per_second']:9.1f} fps  {case['peak_rss_kb'] / 1024:7.1f} MiB"
+    )
+
+
+def compare(results: dict[str, Any], baseline: dict[str, Any], threshold: float) -> bool:
+    """Print the change of every case against ``baseline``, returns False on regressions."""
+    old = {(c['kernel'], c['fixture']): c for c in baseline['cases']}
+    ok = True
+    for case in results['cases']:
+        base = old.get((case['kernel'], case['fixture']))
+        if base is None:
+            print(f"{case['kernel']:<11} {case['fixture']:<7} (new)")
+            continue
+        # different work means the algorithm changed, compare time per unit of work as well
+        ratio = case['best_seconds'] / base['best_seconds'] if base['best_seconds'] else 1.0
+        per_op = case['ns_per_op'] / base['ns_per_op'] if base['ns_per_op'] else 1.0
+        flag = ''
+        if ratio > 1 + threshold:
+            flag = '  REGRESSION'
+            ok = False
+        print(f"{case['kernel']:<11} {case['fixture']:<7} time x{ratio:5.2f}  per-op x{per_op:5.2f}{flag}")
+    return ok
+
+
+def sweep(binary: pathlib.Path) -> dict[str, Any]:
+    proc = subprocess.run([str(binary), 'sweep'], check=True, capture_output=True, text=True)
+    return json.loads(proc.stdout)
+
+
+def main(argv: Optional[list[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-k', '--kernels', default=','.join(KERNELS), help='comma separated kernels to run')
+    parser.add_argument('-r', '--repeat', type=int, default=5)
+    parser.add_argument('-s', '--seed', type=int, default=1234)
+    parser.add_argument('-o', '--output', help='write the results as JSON here')
+    parser.add_argument('-c', '--compare', help='baseline JSON to compare against')
+    parser.add_argument('-t', '--threshold', type=float, default=0.10, help='allowed slowdown, 0.10 is 10%%')
+    parser.add_argument('--cflags', default='', help='extra compiler flags')
+    parser.add_argument('--profile', choices=PROFILES, help='add the flags of a cffi_make build profile')
+    parser.add_argument('--sweep', action='store_true', help='only check the fast CIEDE2000 error bound')
+    args = parser.parse_args(argv)
+
+    flags = PROFILES[args.profile][0] if args.profile else []
+    binary = build([*flags, *shlex.split(args.cflags)])
+    if args.sweep:
+        result = sweep(binary)
+        print(json.dumps(result))
+        return 0 if result['max_error'] <= result['bound'] else 1
+    results = run(binary, kernels=tuple(args.kernels.split(',')), seed=args.seed, repeat=args.repeat)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2)
+    else:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+        if not compare(results, baseline, args.threshold):
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,329 @@
+/*
+ * Benchmark for the salt and colors kernels, without python or the HTTP stack.
+ * Built from the same sources as the cffi extensions by bench/native.py.
+ *
+ *   native_bench <kernel> <fixture.rgba> <seed> <repeat>
+ *
+ * kernel is particles0..particles3, debris, crumble, dust, dustclosed (every frame in one
+ * c_dust_frames call), replace, distance (CIEDE2000),
+ * distance76, distance94 or distance2000fast.
+ * The fixture is "RGBA" + uint32 width + uint32 height + pixels, already padded the
+ * way the routes pad it. Prints one JSON object with the best and median run.
+ *
+ *   native_bench sweep
+ *
+ * compares color_distance2000_fast with color_distance2000 over a grid of colors and
+ * random nearby pairs, prints the largest difference as JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "c_particles.h"
+#include "color_replace.h"
+#include "isa.h"
+
+struct image{
+    unsigned int width, height;
+    unsigned char *pixels;
+};
+typedef struct image Image;
+
+struct result{
+    double seconds;
+    unsigned long long work;
+    unsigned int frames;
+};
+typedef struct result Result;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int load_fixture(const char *path, Image *im){
+    FILE *f = fopen(path, "rb");
+    char magic[4];
+    unsigned int size[2];
+    if (f == NULL){
+        return -1;
+    }
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "RGBA", 4) != 0 || fread(size, sizeof(unsigned int), 2, f) != 2){
+        fclose(f);
+        return -1;
+    }
+    im->width = size[0];
+    im->height = size[1];
+    im->pixels = malloc((size_t)im->width * im->height * 4);
+    if (fread(im->pixels, 4, (size_t)im->width * im->height, f) != (size_t)im->width * im->height){
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static unsigned int count_alpha(const Image *im){
+    unsigned int count = 0;
+    for (size_t i = 0; i < (size_t)im->width * im->height; i++){
+        if (im->pixels[i * 4 + 3] > ALPHA_THRESHOLD){
+            count++;
+        }
+    }
+    return count;
+}
+
+/* the kernels modify their reference, every run gets a fresh copy */
+static Result run_salt(const char *kernel, const Image *im){
+    Result res = {0, 0, 0};
+    SaltStats stats;
+    unsigned int shape[3] = {im->height, im->width, 4};
+    unsigned int stride[3] = {im->width * 4, 4, 1};
+    size_t frame_size = (size_t)im->width * im->height * 4;
+    unsigned int frames;
+    unsigned char *reference = malloc(frame_size), *ret;
+    double start;
+
+    memcpy(reference, im->pixels, frame_size);
+    memset(&stats, 0, sizeof(stats));
+
+    if (strncmp(kernel, "particles", 9) == 0){
+        frames = 120;
+        ret = malloc(frame_size * frames);
+        start = now();
+        c_particles(reference, shape, stride, ret, frame_size, frames, 8, 2, (unsigned int)atoi(kernel + 9), &stats);
+    }else if (strcmp(kernel, "debris") == 0){
+        int *active = calloc((size_t)im->width * im->height, sizeof(int));
+        unsigned char *active_ref = calloc(frame_size, 1);
+        frames = 75;
+        ret = calloc(frame_size * frames, 1);
+        start = now();
+        c_debris(active, reference, active_ref, shape, stride, ret, frame_size, frames, 80, &stats);
+        free(active);
+        free(active_ref);
+    }else if (strcmp(kernel, "crumble") == 0){
+        int *active = calloc((size_t)im->width * im->height, sizeof(int));
+        unsigned char *active_ref = calloc(frame_size, 1);
+        frames = (unsigned int)(im->height / 2.0 + im->width / 4.0);
+        ret = calloc(frame_size * frames, 1);
+        start = now();
+        c_crumble(active, active_ref, reference, shape, stride, ret, frame_size, frames, &stats);
+        free(active);
+        free(active_ref);
+    }else if (strcmp(kernel, "dustclosed") == 0){
+        DustPath *paths = malloc(sizeof(DustPath) * (count_alpha(im) + 1));
+        unsigned int total;
+        frames = (unsigned int)(im->width * .7 + 25);
+        ret = malloc(frame_size * frames);
+        start = now();
+        total = c_dust_paths(reference, shape, stride, frames, paths, &stats);
+        c_dust_frames(paths, total, shape, stride, frames, 0, frames, ret, frame_size, &stats);
+        free(paths);
+    }else{
+        frames = (unsigned int)(im->width * .7 + 25);
+        ret = calloc(frame_size * frames, 1);
+        start = now();
+        c_dust(reference, shape, stride, count_alpha(im), frames, ret, frame_size, &stats);
+    }
+    res.seconds = now() - start;
+    res.work = stats.update_calls;
+    res.frames = frames;
+
+    free(ret);
+    free(reference);
+    return res;
+}
+
+/* every pixel of the fixture as one big palette, transparent black is passed through */
+static Result run_replace(const Image *im){
+    static const unsigned char replacement[] = {255, 0, 0, 0, 255, 0, 0, 0, 255, 240, 200, 20, 130, 20, 200};
+    Result res = {0, 0, 1};
+    ColorStats stats;
+    ReplacedColors table;
+    ToReplace other = {replacement, sizeof(replacement), 0};
+    size_t pixels = (size_t)im->width * im->height;
+    unsigned char *output = malloc(pixels * 3);
+    double start;
+
+    memset(&stats, 0, sizeof(stats));
+    table.colors = create_ptr(sizeof(Replaced), 1);
+    table.current = 0;
+    table.size = 1;
+
+    start = now();
+    replace_colors(im->pixels, (int)pixels, 4, 12.0, METRIC_CIE2000, output, 3, &table, &other, &stats);
+    res.seconds = now() - start;
+    res.work = stats.distance_evals;
+
+    free_ptr(table.colors);
+    free(output);
+    return res;
+}
+
+static int distance_metric(const char *kernel){
+    if (strcmp(kernel, "distance76") == 0){
+        return METRIC_CIE76;
+    }
+    if (strcmp(kernel, "distance94") == 0){
+        return METRIC_CIE94;
+    }
+    if (strcmp(kernel, "distance2000fast") == 0){
+        return METRIC_CIE2000_FAST;
+    }
+    return METRIC_CIE2000;
+}
+
+static Result run_distance(unsigned int count, int metric){
+    Result res = {0, count, 0};
+    unsigned char *pairs = malloc((size_t)count * 6);
+    volatile double sink = 0;
+    double start;
+
+    for (size_t i = 0; i < (size_t)count * 6; i++){
+        pairs[i] = (unsigned char)(rand() & 0xFF);
+    }
+    start = now();
+    for (size_t i = 0; i < count; i++){
+        const unsigned char *p = pairs + i * 6;
+        sink += metric_distance(metric, p[0], p[1], p[2], p[3], p[4], p[5]);
+    }
+    res.seconds = now() - start;
+    (void)sink;
+
+    free(pairs);
+    return res;
+}
+
+struct sweep{
+    double max_error;
+    unsigned char worst[6];
+    unsigned long long pairs;
+};
+
+static void sweep_pair(struct sweep *sw, const unsigned char *p){
+    double exact = color_distance2000(p[0], p[1], p[2], p[3], p[4], p[5]);
+    double fast = color_distance2000_fast(p[0], p[1], p[2], p[3], p[4], p[5]);
+    double error = fabs(fast - exact);
+    if (error > sw->max_error){
+        sw->max_error = error;
+        memcpy(sw->worst, p, 6);
+    }
+    sw->pairs++;
+}
+
+/* every pair of a 16 step grid of colors, then random pairs at most 8 apart per channel */
+static int run_sweep(void){
+    struct sweep sw = {0, {0}, 0};
+    unsigned char p[6];
+    int d;
+    for (int c1 = 0; c1 < 16 * 16 * 16; c1++){
+        p[0] = (c1 >> 8) * 17; p[1] = ((c1 >> 4) & 15) * 17; p[2] = (c1 & 15) * 17;
+        for (int c2 = 0; c2 < 16 * 16 * 16; c2++){
+            p[3] = (c2 >> 8) * 17; p[4] = ((c2 >> 4) & 15) * 17; p[5] = (c2 & 15) * 17;
+            sweep_pair(&sw, p);
+        }
+    }
+    srand(1234);
+    for (int i = 0; i < 4000000; i++){
+        for (int c = 0; c < 3; c++){
+            p[c] = (unsigned char)(rand() & 0xFF);
+            d = p[c] + (rand() % 17) - 8;
+            p[c + 3] = (unsigned char)(d < 0 ? 0 : d > 255 ? 255 : d);
+        }
+        sweep_pair(&sw, p);
+    }
+    printf(
+        "{\"kernel\": \"sweep\", \"pairs\": %llu, \"max_error\": %.9f, \"bound\": %.9f, "
+        "\"worst\": [%u, %u, %u, %u, %u, %u], \"isa\": \"%s\"}\n",
+        sw.pairs, sw.max_error, color_distance2000_fast_error,
+        sw.worst[0], sw.worst[1], sw.worst[2], sw.worst[3], sw.worst[4], sw.worst[5], isa_name()
+    );
+    return 0;
+}
+
+/* VmHWM, ru_maxrss would include the python process that exec'd us */
+static long peak_rss_kb(void){
+    struct rusage usage;
+    char line[256];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f != NULL){
+        while (fgets(line, sizeof(line), f)){
+            if (strncmp(line, "VmHWM:", 6) == 0){
+                kb = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kb < 0){
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+static int compare_seconds(const void *a, const void *b){
+    double x = ((const Result *)a)->seconds, y = ((const Result *)b)->seconds;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]){
+    Image im = {0, 0, NULL};
+    const char *kernel;
+    unsigned int seed, repeat;
+    Result *runs, best, median;
+
+    if (argc == 2 && strcmp(argv[1], "sweep") == 0){
+        return run_sweep();
+    }
+    if (argc != 5){
+        fprintf(stderr, "usage: %s <kernel> <fixture.rgba> <seed> <repeat>\n", argv[0]);
+        return 2;
+    }
+    kernel = argv[1];
+    seed = (unsigned int)strtoul(argv[3], NULL, 10);
+    repeat = (unsigned int)strtoul(argv[4], NULL, 10);
+    if (repeat == 0){
+        repeat = 1;
+    }
+    if (strncmp(kernel, "distance", 8) != 0 && load_fixture(argv[2], &im) != 0){
+        fprintf(stderr, "could not read fixture %s\n", argv[2]);
+        return 1;
+    }
+
+    runs = malloc(sizeof(Result) * repeat);
+    for (unsigned int i = 0; i < repeat; i++){
+        // same random stream for every run
+        srand(seed);
+        if (strcmp(kernel, "replace") == 0){
+            runs[i] = run_replace(&im);
+        }else if (strncmp(kernel, "distance", 8) == 0){
+            runs[i] = run_distance(1000000, distance_metric(kernel));
+        }else{
+            runs[i] = run_salt(kernel, &im);
+        }
+    }
+    qsort(runs, repeat, sizeof(Result), compare_seconds);
+    best = runs[0];
+    median = runs[repeat / 2];
+
+    printf(
+        "{\"kernel\": \"%s\", \"width\": %u, \"height\": %u, \"repeat\": %u, "
+        "\"best_seconds\": %.9f, \"median_seconds\": %.9f, \"work\": %llu, "
+        "\"ns_per_op\": %.3f, \"frames\": %u, \"frames_per_second\": %.3f, \"peak_rss_kb\": %ld, \"isa\": \"%s\"}\n",
+        kernel, im.width, im.height, repeat,
+        best.seconds, median.seconds, best.work,
+        best.work ? best.seconds * 1e9 / best.work : 0.0,
+        best.frames, best.seconds > 0 ? best.frames / best.seconds : 0.0,
+        peak_rss_kb(), isa_name()
+    );
+
+    free(runs);
+    free(im.pixels);
+    return 0;
+}
@@ -0,0 +1,67 @@
+"""Runs every salt and colors kernel through the built cffi extensions over the
+benchmark fixtures: ``python -m bench.workload [repeat]``
+
+The training run of the PGO build profile, and how cffi_make times one build
+against another. Prints JSON, the best kernel time of each case and their total.
+"""
+from __future__ import annotations
+from typing import Any
+
+import sys
+import json
+import time
+
+import numpy as np
+from PIL import Image
+
+from routes.utils.img_utils import decode_rgba
+from routes.src.salt import py_cffi_salt as salt_ext
+from routes.src.colors import py_cffi_colors as colors_ext
+
+from .fixtures import fixture_paths
+from .native import KERNELS, _geometry, _padding
+
+REPLACEMENT = [[255, 0, 0], [0, 255, 0], [0, 0, 255], [240, 200, 20], [130, 20, 200]]
+
+
+def _run(kernel: str, arr: np.ndarray):
+    if kernel.startswith('particles'):
+        salt_ext.draw_particles(arr, frames=120, new_particles=8, skip=2, particle_type=int(kernel[9:]))
+    elif kernel == 'debris':
+        salt_ext.draw_debris.original(arr, num_frames=75, percent=80)
+    elif kernel == 'crumble':
+        salt_ext.draw_crumble.original(arr)
+    elif kernel == 'dust':
+        salt_ext.draw_dust.original(arr)
+    elif kernel == 'dustclosed':
+        for _ in salt_ext.dust_frames(arr):
+            pass
+    else:
+        with colors_ext.ColorTable(REPLACEMENT) as table:
+            table.replace(arr.reshape(-1, 4), 12.0)
+
+
+def run(repeat: int = 3) -> dict[str, Any]:
+    cases = {}
+    for name, path in fixture_paths().items():
+        for kernel in KERNELS:
+            # distance has no extension entry point worth timing on its own
+            if kernel.startswith('distance'):
+                continue
+            with Image.open(path) as im:
+                w, h = _geometry(kernel, im.size)
+                arr = decode_rgba(im, (w, h), pad=_padding(kernel, w, h))
+            best = float('inf')
+            for _ in range(repeat):
+                # the salt kernels modify their input
+                work = arr.copy()
+                start = time.perf_counter()
+                _run(kernel, work)
+                best = min(best, time.perf_counter() - start)
+            cases[f'{kernel}/{name}'] = best
+    return {'cases': cases, 'total_seconds': sum(cases.values())}
+
+
+if __name__ == '__main__':
+    json.dump(run(int(sys.argv[1]) if len(sys.argv) > 1 else 3), sys.stdout, indent=2)
+    print()
@@ -1,9 +1,11 @@
 import os
+import sys
 import cffi_make
 
 os.system('pip install -U wheel setuptools')
 os.system('pip install -Ur requirements.txt')
 
-cffi_make.build()
+# optional build profile: portable (default), native or pgo
+cffi_make.build(*sys.argv[1:2])
 
 # gunicorn main:app -c gunicorn_pref.py
\ No newline at end of file
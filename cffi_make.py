@@ -1,18 +1,33 @@
-
 import os
+import sys
+import glob
+import json
 import importlib
 import traceback
+import subprocess
+
+
+# build profile -> (compile args, link args), added after python's own CFLAGS (GCC flags)
+PROFILES = {
+    # safe to copy to another machine
+    'portable': (['-O3'], []),
+    # only for the machine it's built on
+    'native': (['-O3', '-march=native', '-mtune=native', '-flto'], ['-O3', '-flto']),
+}
+# 'pgo' is native plus a profile from running bench.workload on an instrumented build
+PGO_GENERATE = (['-fprofile-generate', '-fprofile-update=atomic'], ['-fprofile-generate'])
+PGO_USE = (['-fprofile-use', '-fprofile-partial-training', '-Wno-missing-profile'], ['-fprofile-use'])
 
 
 # cffi
-def build():
+def _build_all(compile_args=(), link_args=()):
     path = 'routes/src'
     for folder in os.listdir(path):
         folder_path = f'{path}.{folder}.cffi_make'.replace("/", ".")
         try:
             cffi = importlib.import_module(folder_path)
             print(f'==== Building {folder.replace("/", ".")} ...')
-            cffi.build()
+            cffi.build(extra_compile_args=list(compile_args), extra_link_args=list(link_args))
         except (ModuleNotFoundError):
             print(f'==== Skipping {folder.replace("/", ".")}')
         except Exception as e:
@@ -21,5 +36,40 @@ def build():
         print('\n')
 
 
+def _workload(repeat: int) -> float:
+    # new process, the extensions were rebuilt and profile data is written at exit
+    proc = subprocess.run(
+        [sys.executable, '-m', 'bench.workload', str(repeat)], check=True, capture_output=True, text=True
+    )
+    return json.loads(proc.stdout)['total_seconds']
+
+
+def _build_pgo():
+    compile_args, link_args = PROFILES['native']
+    for gcda in glob.glob('routes/src/*/*.gcda'):
+        os.remove(gcda)
+
+    _build_all(compile_args, link_args)
+    before = _workload(3)
+
+    _build_all(compile_args + PGO_GENERATE[0], link_args + PGO_GENERATE[1])
+    print('==== Training ...')
+    _workload(1)
+
+    _build_all(compile_args + PGO_USE[0], link_args + PGO_USE[1])
+    after = _workload(3)
+    print(f'==== PGO: kernels {before:.3f}s -> {after:.3f}s, {before / after:.2f}x over native')
+
+
+def build(profile: str = 'portable'):
+    """Build every cffi extension with one of PROFILES or 'pgo'."""
+    if profile == 'pgo':
+        _build_pgo()
+    elif profile in PROFILES:
+        _build_all(*PROFILES[profile])
+    else:
+        raise ValueError(f'unknown build profile {profile!r}, one of: {", ".join([*PROFILES, "pgo"])}')
+
+
 if __name__ == '__main__':
-    build()
+    build(*sys.argv[1:2])
@@ -6,11 +6,12 @@ except Exception:
 else:
     uvloop.install()
 
+import os
 from contextlib import asynccontextmanager
 
 from fastapi import FastAPI, Request
 from fastapi.staticfiles import StaticFiles
-from fastapi.responses import ORJSONResponse, HTMLResponse, FileResponse
+from fastapi.responses import ORJSONResponse, HTMLResponse, FileResponse, PlainTextResponse
 
 from slowapi.extension import Limiter, _rate_limit_exceeded_handler
 from slowapi.util import get_remote_address
@@ -20,39 +21,55 @@ from slowapi.errors import RateLimitExceeded
 from uvicorn.middleware.proxy_headers import ProxyHeadersMiddleware
 
 from routes.errors.errors import *
-from routes import colors, salt, runescape
+from routes import colors, salt, runescape, batch
+from routes.utils.metrics import METRICS, MetricsMiddleware
+from routes.src.salt import py_cffi_salt
+from routes.src.colors import py_cffi_colors
 
-from plugins import FPngPlugin
+from plugins import FPngPlugin, APngPlugin
 
 FPngPlugin.plug()
+APngPlugin.plug()
+
+METRICS.build_info.update(salt_isa=py_cffi_salt.active_isa(), colors_isa=py_cffi_colors.active_isa())
 
 
 @asynccontextmanager
 async def lifespan(app: FastAPI):
+    # optional process pool for the compute endpoints, 0 or unset keeps everything on threads
+    from routes.utils.process_pool import start_process_pool, stop_process_pool
+    workers = int(os.environ.get('ZNEITIZ_PROCESS_WORKERS') or 0)
+    if workers > 0:
+        app.state.pool = start_process_pool(workers)
     yield
     # clean up the session
     from routes.utils.session import close_sesssion
     await close_sesssion(app)
+    stop_process_pool()
+    app.state.pool = None
 
 
 app = FastAPI(title='zNeitiz', summary='zNeitiz Image API', lifespan=lifespan)
 app.mount("/static", StaticFiles(directory="static"), name="static")
 
-app.state.session = app.state.pool = None
+app.state.session = app.state.pool = app.state.scheduler = None
 
-# slowapi limiter
+# slowapi limiter, ZNEITIZ_RATE_LIMIT=0 turns it off (load tests)
 limiter = Limiter(
     key_func=get_remote_address,
     default_limits=["10/minute"],
-    headers_enabled=True
+    headers_enabled=True,
+    enabled=os.environ.get('ZNEITIZ_RATE_LIMIT', '1') != '0'
 )
 # TODO check on this later for errors?
 app.state.limiter = limiter
 app.add_exception_handler(RateLimitExceeded, _rate_limit_exceeded_handler)  # type: ignore  # from slowapi docs
 app.add_middleware(SlowAPIMiddleware)
 app.add_middleware(ProxyHeadersMiddleware)  # type: ignore  # i found this somewhere but I don't remember where
+# ?trace=1 needs this token in X-Trace-Token, unset disables tracing
+app.add_middleware(MetricsMiddleware, trace_token=os.environ.get('ZNEITIZ_TRACE_TOKEN'))
 
-for module in (colors, salt, runescape):
+for module in (colors, salt, runescape, batch):
     app.include_router(module.router)
 
 
@@ -62,6 +79,13 @@ async def favicon():
     return FileResponse('static/favicon.ico')
 
 
+# prometheus scrape target
+@app.get('/metrics', include_in_schema=False)
+@limiter.exempt
+def metrics(r: Request):
+    return PlainTextResponse(METRICS.render(), media_type='text/plain; version=0.0.4')
+
+
 @app.get('/', response_class=HTMLResponse)
 @limiter.exempt
 def home(r: Request):
@@ -120,4 +144,8 @@ def self_test(r: Request):
 
 @app.exception_handler(ZNeitizException)
 async def base_exception(request: Request, exc):
-    return ORJSONResponse(status_code=exc.status, content={'message': exc.message})
+    return ORJSONResponse(
+        status_code=exc.status,
+        content={'message': exc.message},
+        headers=getattr(exc, 'headers', None)
+    )
@@ -0,0 +1,113 @@
+import io
+import struct
+import zlib
+import itertools
+
+from PIL import Image
+
+__all__ = ('plug',)
+
+_SIGNATURE = b'\x89PNG\r\n\x1a\n'
+
+
+def _chunk(type: bytes, data: bytes) -> bytes:
+    return struct.pack('>I', len(data)) + type + data + struct.pack('>I', zlib.crc32(type + data))
+
+
+def _chunks(data: bytes):
+    pos = len(_SIGNATURE)
+    while pos < len(data):
+        length, = struct.unpack_from('>I', data, pos)
+        yield data[pos+4:pos+8], data[pos+8:pos+8+length]
+        pos += length + 12
+
+
+def _encode_frame(im: Image.Image) -> tuple[bytes, list[bytes]]:
+    """IHDR and IDAT payloads of ``im`` encoded as a PNG, by fpng when it's plugged in."""
+    b = io.BytesIO()
+    im.save(b, format='fpng' if 'FPNG' in Image.SAVE else 'png')
+    header = b''
+    idat = []
+    for type, data in _chunks(b.getvalue()):
+        if type == b'IHDR':
+            header = data
+        elif type == b'IDAT':
+            idat.append(data)
+    return header, idat
+
+
+def _delay(ms: float) -> tuple[int, int]:
+    # fcTL delay is a 16 bit fraction of a second
+    ms = max(0, int(round(ms)))
+    return (ms, 1000) if ms <= 0xFFFF else (min(ms // 10, 0xFFFF), 100)
+
+
+def _save_all(im: Image.Image, fp, filename=None):
+    """Every frame is encoded as a complete PNG of its own and its image data moved into
+    fdAT chunks, so the fast single frame encoders do all of the work. Frames replace the
+    whole canvas (APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE), every frame shows as it is
+    like in the gifs of this API. Frames are written as they're encoded and the frame count
+    in acTL is filled in at the end, buffered when ``fp`` can't seek."""
+    info = im.encoderinfo
+    # without a duration every frame keeps the one in its info, like the gif encoder
+    duration = info.get('duration')
+    loop = info.get('loop', 0)
+    out = fp if getattr(fp, 'seekable', lambda: False)() else io.BytesIO()
+
+    # the first frame decides the mode, all frames have to share one IHDR
+    mode = 'RGBA' if im.mode in ('RGBA', 'LA', 'PA') or 'transparency' in im.info else 'RGB'
+    header = None
+    sequence = itertools.count()
+    frames = 0
+    for index, frame in enumerate(itertools.chain([im], info.get('append_images', []))):
+        if frame.mode != mode:
+            frame = frame.convert(mode)
+        frame_header, idat = _encode_frame(frame)
+        if header is None:
+            header = frame_header
+            out.write(_SIGNATURE)
+            out.write(_chunk(b'IHDR', header))
+            actl = out.tell()
+            out.write(_chunk(b'acTL', struct.pack('>II', 0, loop)))
+        elif frame_header != header:
+            raise ValueError('APNG frames must all have the same size')
+        if isinstance(duration, (list, tuple)):
+            frame_duration = duration[index]
+        else:
+            frame_duration = frame.info.get('duration', 0) if duration is None else duration
+
+        width, height = frame.size
+        out.write(_chunk(b'fcTL', struct.pack(
+            '>IIIIIHHBB', next(sequence), width, height, 0, 0, *_delay(frame_duration), 0, 0
+        )))
+        for data in idat:
+            if index == 0:
+                # the first frame is also the default image
+                out.write(_chunk(b'IDAT', data))
+            else:
+                out.write(_chunk(b'fdAT', struct.pack('>I', next(sequence)) + data))
+        frames += 1
+
+    assert header is not None
+    out.write(_chunk(b'IEND', b''))
+    end = out.tell()
+    out.seek(actl)
+    out.write(_chunk(b'acTL', struct.pack('>II', frames, loop)))
+    out.seek(end)
+    if out is not fp:
+        fp.write(out.getvalue())
+
+
+def _save(im: Image.Image, fp, filename=None):
+    # without save_all, an animation of one frame
+    im.encoderinfo['append_images'] = []
+    _save_all(im, fp, filename)
+
+
+def plug():
+    try:
+        Image.register_save('APNG', _save)
+        Image.register_save_all('APNG', _save_all)
+    except Exception:
+        import traceback
+        traceback.print_exc()
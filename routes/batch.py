@@ -0,0 +1,179 @@
+import io
+import typing
+import asyncio
+import zipfile
+
+import numpy as np
+from PIL import Image
+from pydantic import BaseModel, Field
+from fastapi import APIRouter, Body, UploadFile
+from fastapi.responses import Response
+from starlette.requests import Request
+
+from .errors.errors import *
+from .utils.session import get_image_url, check_limits, IMAGE_LIMITS
+from .utils.img_utils import fit_size, decode_reduced, pad_rgba
+from .utils.scheduler import admit, get_scheduler, client_host, image_cost
+from .utils.metrics import span
+from .utils.function_utils import in_executor, model_checker, get_upload_file
+from .src.salt import py_cffi_salt as salt_ext
+from . import salt, colors
+
+MAX_EFFECTS = 8
+
+
+# effect specs, the options of each endpoint
+class ParticlesEffect(salt.ParticleOptions):
+    effect: typing.Literal['particles']
+
+
+class ExplodeEffect(salt.ExplodeOptions):
+    effect: typing.Literal['explode']
+
+
+class DustEffect(salt.DustOptions):
+    effect: typing.Literal['dust']
+
+
+class SandEffect(salt.SandOptions):
+    effect: typing.Literal['sand']
+
+
+class ReplaceColorsEffect(colors.ReplaceBody):
+    effect: typing.Literal['replace_colors']
+
+
+Effect = typing.Annotated[
+    typing.Union[ParticlesEffect, ExplodeEffect, DustEffect, SandEffect, ReplaceColorsEffect],
+    Field(discriminator='effect'),
+]
+
+
+class BatchBody(BaseModel):
+    effects: typing.Annotated[list[Effect], Field(min_length=1, max_length=MAX_EFFECTS)]
+
+
+class BatchBodyURL(BatchBody):
+    image_url: str
+
+
+router = APIRouter(
+    prefix='/image',
+    tags=['image']
+)
+
+
+@in_executor()
+def _decode_bases(im: Image.Image, keys: set[tuple]) -> dict[tuple, np.ndarray]:
+    """Unpadded RGBA of ``im`` at every (size, resample), decoded once. Largest first, a JPEG
+    is drafted for that one and the smaller sizes are resized from the same decode."""
+    bases = {}
+    for size, resample in sorted(keys, key=lambda key: key[0], reverse=True):
+        resized = decode_reduced(im, size, resample=resample)
+        bases[size, resample] = np.asarray(resized if resized.mode == 'RGBA' else resized.convert('RGBA'))
+    return bases
+
+
+def _base_key(effect, sizes: dict[str, tuple[int, int]]) -> tuple:
+    return sizes[effect.effect], salt.grid_resample(getattr(effect, 'sim_scale', 1))
+
+
+async def _run_effect(
+    request: Request,
+    effect: Effect,
+    im_bytes: bytes,
+    bases: dict[tuple[int, int], np.ndarray],
+    sizes: dict[str, tuple[int, int]],
+) -> io.BytesIO:
+    name = effect.effect
+    if name == 'replace_colors':
+        cost = image_cost(name, im_bytes, max_size=512)
+    else:
+        cost = salt.scaled_cost(image_cost(name, im_bytes, **salt.EFFECT_FIT[name], animated=False), getattr(effect, 'sim_scale', 1))
+
+    async with get_scheduler(request.app).admit(name, client_host(request), cost):
+        if isinstance(effect, ReplaceColorsEffect):
+            # needs every frame at its own size, works on its own copy of the image
+            with io.BytesIO(im_bytes) as file:
+                with Image.open(file) as im:
+                    output, _ = await colors.recolor(request, im, colors.flatten_colors(effect.colors), effect, im_bytes)
+                    return output
+
+        base = bases[_base_key(effect, sizes)]
+        # the Accept header is about the zip, only a format in the spec counts
+        fmt = effect.format or 'gif'
+        if isinstance(effect, ParticlesEffect):
+            skip = effect.speed or 2
+            new_particles = effect.amount or 8
+            return await salt.render_particles(
+                pad_rgba(base, salt.particles_padding(skip, new_particles)),
+                num_frames=120,
+                new_particles=new_particles,
+                skip=skip,
+                particle_type=effect.particle_type.value if effect.particle_type else 0,
+                sim_scale=effect.sim_scale,
+                fmt=fmt,
+            )
+        if isinstance(effect, ExplodeEffect):
+            return await salt.render_explode(
+                pad_rgba(base, salt.EXPLODE_PADDING), percent=effect.percent or 80, sim_scale=effect.sim_scale, fmt=fmt
+            )
+        h, w = base.shape[:2]
+        if isinstance(effect, DustEffect):
+            return await salt.render_dust(pad_rgba(base, salt_ext.dust_padding(h, w)), fmt=fmt, mode=effect.mode)
+        return await salt.render_sand(pad_rgba(base, salt_ext.crumble_padding(h, w)), sim_scale=effect.sim_scale, fmt=fmt)
+
+
+def _media_type(data: bytes) -> str:
+    return 'gif' if data.startswith(b'GIF') else 'png'
+
+
+async def _batch(request: Request, im_bytes: bytes, effects: list) -> Response:
+    for effect in effects:
+        check_limits(im_bytes, IMAGE_LIMITS[effect.effect])
+
+    async with admit(request, 'batch', image_cost('batch', im_bytes, max_size=600, animated=False)):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                sizes = {
+                    effect.effect: fit_size(im.size, **salt.EFFECT_FIT[effect.effect])
+                    for effect in effects if effect.effect in salt.EFFECT_FIT
+                }
+                with span('decode'):
+                    bases = await _decode_bases(
+                        im, {_base_key(effect, sizes) for effect in effects if effect.effect in sizes}
+                    )
+    if any(not base[..., 3].any() for base in bases.values()):
+        raise ZNeitizException(400, 'Cannot be a blank image')
+
+    # every effect gets its own slot of its endpoint, they run side by side
+    tasks = [asyncio.ensure_future(_run_effect(request, effect, im_bytes, bases, sizes)) for effect in effects]
+    try:
+        outputs = await asyncio.gather(*tasks)
+    except BaseException:
+        for task in tasks:
+            task.cancel()
+        raise
+
+    b = io.BytesIO()
+    # the images are compressed already
+    with zipfile.ZipFile(b, 'w', zipfile.ZIP_STORED) as archive:
+        for index, (effect, output) in enumerate(zip(effects, outputs)):
+            data = output.read()
+            archive.writestr(f'{index}_{effect.effect}.{_media_type(data)}', data)
+    return Response(b.getvalue(), media_type='application/zip')
+
+
+@router.post('/batch')
+async def batch(request: Request, args: BatchBodyURL = Body(...)):
+    """Several effects on one image, fetched and decoded once. Responds with a zip of
+    ``<index>_<effect>.gif|png``, in the order of ``effects``."""
+    im_bytes = await get_image_url(request.app, args.image_url)
+    return await _batch(request, im_bytes, args.effects)
+
+
+@router.post('/batch/file')
+async def batch_file(request: Request, image: UploadFile, args: BatchBody = model_checker(BatchBody)):
+    im_bytes = await get_upload_file(image)
+    await image.close()
+    return await _batch(request, im_bytes, args.effects)
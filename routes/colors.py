@@ -8,16 +8,24 @@ from fastapi.responses import Response
 from starlette.requests import Request
 
 from .errors.errors import *
-from .utils.session import get_image_url
+from .utils.session import get_image_url, IMAGE_LIMITS
 from .src.colors import py_cffi_colors as colors_ext
-from .utils.function_utils import model_checker, get_upload_file
+from .utils.function_utils import model_checker, get_upload_file, animation_format, AnimationFormat
+from .utils.scheduler import admit, image_cost
 
 
 # File based
 class ReplaceBody(BaseModel):
     colors: typing.Annotated[list[list[int]] , list[list[conint(ge=0, lt=256)]]]
     animated: typing.Optional[bool] = None
+    # in the units of metric
     max_distance: typing.Annotated[float, Field(strict=True, gt=0, allow_inf_nan=False)] = 16.0
+    metric: colors_ext.ColorMetric = 'cie2000'
+    # of an animated output, gif or apng, the Accept header decides when it's not given
+    format: typing.Optional[AnimationFormat] = None
+    # recolor the color tables of an indexed gif/png in place, same size and timing as the
+    # input but without the 2x resampling of the pixel path, so the output differs from it
+    palette: bool = False
 
 
 class MergeBody(BaseModel):
@@ -26,6 +34,9 @@ class MergeBody(BaseModel):
     num_colors: typing.Annotated[int, Field(strict=True, gt=0, lt=256)] = 16
     animated: typing.Optional[bool] = None
     max_distance: typing.Annotated[float, Field(strict=True, gt=0, allow_inf_nan=False, default=16.0)] = 16.0
+    metric: colors_ext.ColorMetric = 'cie2000'
+    format: typing.Optional[AnimationFormat] = None
+    palette: bool = False
 
 
 # url based
@@ -39,6 +50,9 @@ class MergeBodyURL(BaseModel):
     num_colors: typing.Annotated[int, Field(strict=True, gt=0, lt=256, default=16)] = 16
     animated: typing.Optional[bool] = None
     max_distance: typing.Annotated[float, Field(strict=True, gt=0, allow_inf_nan=False, default=16.0)] = 16.0
+    metric: colors_ext.ColorMetric = 'cie2000'
+    format: typing.Optional[AnimationFormat] = None
+    palette: bool = False
 
 
 router = APIRouter(
@@ -47,12 +61,7 @@ router = APIRouter(
 )
 
 
-@router.post('/replace_colors')
-async def replace_colors(request: Request, args: ReplaceBodyURL = Body(...)):
-    app = request.app
-    image_url = args.image_url
-
-    inputcolors = args.colors
+def flatten_colors(inputcolors: list[list[int]]) -> list[int]:
     colors = []
     for color in inputcolors:
         if not all(isinstance(num, int) and 0 <= num < 256 for num in color):
@@ -60,19 +69,57 @@ async def replace_colors(request: Request, args: ReplaceBodyURL = Body(...)):
         colors.extend(color)
     if len(colors) % 3:
         raise ZNeitizException(400, 'colors must be a multiple of 3.')
+    return colors
+
 
-    max_distance = args.max_distance
+async def recolor(
+    request: Request,
+    im: Image.Image,
+    colors: list[int],
+    args: typing.Union[ReplaceBody, MergeBody, MergeBodyURL],
+    data: typing.Optional[bytes] = None,
+) -> tuple[io.BytesIO, str]:
+    """Recolor ``im`` with the options in ``args``, returns the image and its format.
+    ``data``, the bytes ``im`` was opened from, is needed for ``args.palette``."""
     animated = args.animated
+    if animated is None:
+        animated = getattr(im, 'n_frames', 1) > 1
+    if not animated:
+        if args.palette and data is not None and im.format == 'PNG':
+            output = await colors_ext.replace_indexed_colors(
+                data, colors, args.max_distance, mime='image/png', lc=min(len(colors)//3 + 1, 256),
+                newsize=1024, max_frames=1, metric=args.metric
+            )
+            if output is not None:
+                return output, 'png'
+        return await colors_ext.replace_single_colors(im, colors, max_dist=args.max_distance, metric=args.metric), 'png'
+
+    fmt = animation_format(request, args.format)
+    if args.palette and data is not None and im.format == 'GIF' and fmt == 'gif':
+        output = await colors_ext.replace_indexed_colors(
+            data, colors, args.max_distance, mime='image/gif', lc=len(colors)//3,
+            newsize=512, max_frames=200, metric=args.metric
+        )
+        if output is not None:
+            return output, 'gif'
+    return await colors_ext.replace_gif_colors(im, colors, max_dist=args.max_distance, fmt=fmt, metric=args.metric), fmt
+
+
+@router.post('/replace_colors')
+async def replace_colors(request: Request, args: ReplaceBodyURL = Body(...)):
+    app = request.app
+    image_url = args.image_url
+
+    colors = flatten_colors(args.colors)
 
-    im_bytes = await get_image_url(app, image_url)
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            if animated is None:
-                animated = getattr(im, 'n_frames', 1) > 1
-            func = colors_ext.replace_gif_colors if animated else colors_ext.replace_single_colors
-            image = await func(im, colors, max_dist=max_distance)
+    im_bytes = await get_image_url(app, image_url, limits=IMAGE_LIMITS['replace_colors'])
+    cost = image_cost('replace_colors', im_bytes, max_size=512)
+    async with admit(request, 'replace_colors', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                image, fmt = await recolor(request, im, colors, args, im_bytes)
 
-    return Response(image.read(), media_type=f"image/{'gif' if animated else 'png'}")
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/replace_colors/file')
@@ -82,29 +129,18 @@ async def replace_colors_file(
     args: ReplaceBody = model_checker(ReplaceBody),
 ):
 
-    inputcolors = args.colors
-    colors = []
-    for color in inputcolors:
-        if not all(isinstance(num, int) and 0 <= num < 256 for num in color):
-            raise ZNeitizException(400, 'colors must be list of RGB colors.')
-        colors.extend(color)
-    if len(colors) % 3:
-        raise ZNeitizException(400, 'colors must be a multiple of 3.')
+    colors = flatten_colors(args.colors)
 
-    max_distance = args.max_distance
-    animated = args.animated
-
-    im_bytes = await get_upload_file(image)
+    im_bytes = await get_upload_file(image, limits=IMAGE_LIMITS['replace_colors'])
     await image.close()
 
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            if animated is None:
-                animated = getattr(im, 'n_frames', 1) > 1
-            func = colors_ext.replace_gif_colors if animated else colors_ext.replace_single_colors
-            output = await func(im, colors, max_dist=max_distance)
+    cost = image_cost('replace_colors', im_bytes, max_size=512)
+    async with admit(request, 'replace_colors', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                output, fmt = await recolor(request, im, colors, args, im_bytes)
 
-    return Response(output.read(), media_type=f"image/{'gif' if animated else 'png'}")
+    return Response(output.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/merge_colors')
@@ -113,21 +149,18 @@ async def merge_colors(request: Request, args: MergeBodyURL = Body(...)):
     destination = args.destination_url
     source = args.source_url
 
-    max_distance = args.max_distance
-    animated = args.animated
-
-    im_bytes = await get_image_url(app, destination)
-    with Image.open(io.BytesIO(await get_image_url(app, source))) as im:
-        colors = await colors_ext.extract_colors(im, args.num_colors)
+    im_bytes = await get_image_url(app, destination, limits=IMAGE_LIMITS['replace_colors'])
+    source_bytes = await get_image_url(app, source, limits=IMAGE_LIMITS['merge_source'])
+    cost = image_cost('merge_colors', im_bytes, max_size=512)
+    async with admit(request, 'merge_colors', cost):
+        with Image.open(io.BytesIO(source_bytes)) as im:
+            colors = await colors_ext.extract_colors(im, args.num_colors)
 
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            if animated is None:
-                animated = getattr(im, 'n_frames', 1) > 1
-            func = colors_ext.replace_gif_colors if animated else colors_ext.replace_single_colors
-            image = await func(im, colors, max_dist=max_distance)
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                image, fmt = await recolor(request, im, colors, args, im_bytes)
 
-    return Response(image.read(), media_type=f"image/{'gif' if animated else 'png'}")
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/merge_colors/file')
@@ -140,33 +173,29 @@ async def merge_colors_file(
 
     app = request.app
 
-    max_distance = args.max_distance
-    animated = args.animated
-
     if destination_image:
-        destination_bytes = await get_upload_file(destination_image)
+        destination_bytes = await get_upload_file(destination_image, limits=IMAGE_LIMITS['replace_colors'])
         await destination_image.close()
     elif args.destination_url:
-        destination_bytes = await get_image_url(app, args.destination_url)
+        destination_bytes = await get_image_url(app, args.destination_url, limits=IMAGE_LIMITS['replace_colors'])
     else:
         raise ZNeitizException(message='"destination_image" or "destination_url" is required.')
 
     if source_image:
-        source_bytes = await get_upload_file(source_image)
+        source_bytes = await get_upload_file(source_image, limits=IMAGE_LIMITS['merge_source'])
         await source_image.close()
     elif args.source_url:
-        source_bytes = await get_image_url(app, args.source_url)
+        source_bytes = await get_image_url(app, args.source_url, limits=IMAGE_LIMITS['merge_source'])
     else:
         raise ZNeitizException(message='"source_image" or "source_url" is required.')
 
-    with Image.open(io.BytesIO(source_bytes)) as im:
-        colors = await colors_ext.extract_colors(im, args.num_colors)
+    cost = image_cost('merge_colors', destination_bytes, max_size=512)
+    async with admit(request, 'merge_colors', cost):
+        with Image.open(io.BytesIO(source_bytes)) as im:
+            colors = await colors_ext.extract_colors(im, args.num_colors)
 
-    with io.BytesIO(destination_bytes) as file:
-        with Image.open(file) as im:
-            if animated is None:
-                animated = getattr(im, 'n_frames', 1) > 1
-            func = colors_ext.replace_gif_colors if animated else colors_ext.replace_single_colors
-            image = await func(im, colors, max_dist=max_distance)
+        with io.BytesIO(destination_bytes) as file:
+            with Image.open(file) as im:
+                image, fmt = await recolor(request, im, colors, args, destination_bytes)
 
-    return Response(image.read(), media_type=f"image/{'gif' if animated else 'png'}")
+    return Response(image.read(), media_type=f'image/{fmt}')
@@ -1,7 +1,7 @@
 from __future__ import annotations
 from typing import Optional
 
-__all__ = ('ZNeitizException', 'UnsupportedType', 'PayloadTooLarge', 'TooManyRequests')
+__all__ = ('ZNeitizException', 'UnsupportedType', 'PayloadTooLarge', 'TooManyRequests', 'ServiceUnavailable')
 
 
 class ZNeitizException(Exception):
@@ -23,3 +23,9 @@ class PayloadTooLarge(ZNeitizException):
 class TooManyRequests(ZNeitizException):
     def __init__(self, message: Optional[str] = None):
         super().__init__(429, message or 'Too many requests.')
+
+
+class ServiceUnavailable(ZNeitizException):
+    def __init__(self, message: Optional[str] = None, *, retry_after: Optional[int] = None):
+        super().__init__(503, message or 'Server is busy, try again later.')
+        self.headers = {'Retry-After': str(retry_after)} if retry_after else None
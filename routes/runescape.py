@@ -1,10 +1,14 @@
+import typing
 
 from pydantic import BaseModel
 from fastapi import APIRouter, Body
 from fastapi.responses import Response
+from starlette.requests import Request
 
 from .errors.errors import *
 from .src.runescape import _runescape
+from .utils.scheduler import admit, text_cost
+from .utils.function_utils import animation_format, AnimationFormat
 
 
 router = APIRouter(prefix='/image', tags=['image'])
@@ -12,15 +16,18 @@ router = APIRouter(prefix='/image', tags=['image'])
 
 class RunescapeInput(BaseModel):
     text: str
+    # of an animated output, gif or apng, the Accept header decides when it's not given
+    format: typing.Optional[AnimationFormat] = None
 
 
 @router.post('/runescape')
-async def runescape(args: RunescapeInput = Body(...)):
+async def runescape(request: Request, args: RunescapeInput = Body(...)):
     text = args.text
     if len(text) > 100:
         raise ZNeitizException(400, 'Text length must be <= 100')
 
-    file, type = await _runescape.runescape(text)
+    async with admit(request, 'runescape', text_cost('runescape', text)):
+        file, type = await _runescape.runescape(text, animation_format(request, args.format))
 
     if file is None:
         raise ZNeitizException(400, 'Invalid text input')
@@ -1,5 +1,6 @@
 import io
 import typing
+import itertools
 from enum import IntEnum
 
 import numpy as np
@@ -10,10 +11,14 @@ from fastapi.responses import Response
 from starlette.requests import Request
 
 from .errors.errors import *
-from .utils.session import get_image_url
-from .utils.img_utils import _limit_size
+from .utils.session import get_image_url, IMAGE_LIMITS
+from .utils.img_utils import fit_size, decode_rgba
+from .utils.scheduler import admit, image_cost
+from .utils.metrics import span
+from .utils.frame_store import frame_images
+from .utils.gif_writer import save_gif
 from .src.salt import py_cffi_salt as salt_ext
-from .utils.function_utils import in_executor, model_checker, get_upload_file
+from .utils.function_utils import in_executor, model_checker, get_upload_file, animation_format, AnimationFormat
 
 router = APIRouter(
     prefix='/image',
@@ -29,17 +34,36 @@ class ParticleType(IntEnum):
 #typing.Annotated[int, Field(strict=True, gt=0, lt=256)] = 16
 
 # file models
-class ParticleOptions(BaseModel):
+class AnimationOptions(BaseModel):
+    # gif or apng, the Accept header decides when it's not given
+    format: typing.Optional[AnimationFormat] = None
+
+
+class ScaledOptions(AnimationOptions):
+    # output this many times the usual size, the simulation runs at the usual size
+    sim_scale: salt_ext.SimScale = 1
+
+
+class ParticleOptions(ScaledOptions):
     particle_type: typing.Optional[ParticleType] = ParticleType.salt
     speed: typing.Annotated[typing.Optional[int], Field(strict=True, gt=0, le=10, default=2)] = 2
     amount: typing.Annotated[typing.Optional[int], Field(strict=True, gt=0, le=20, default=8)] = 8
 
 
-class ExplodeOptions(BaseModel):
+class SandOptions(ScaledOptions):
+    pass
+
+
+class DustOptions(AnimationOptions):
+    # closed draws every frame on its own, a bit different from stepped but the same look
+    mode: salt_ext.DustMode = 'stepped'
+
+
+class ExplodeOptions(ScaledOptions):
     percent: typing.Annotated[typing.Optional[int], Field(strict=True, gt=0, le=100, default=80)] = 80
 
 # URL models
-class ParticleBodyURL(BaseModel):
+class ParticleBodyURL(AnimationOptions):
     image_url: str
 
 class ExplodeOptionsURL(ParticleBodyURL, ExplodeOptions):
@@ -48,9 +72,38 @@ class ExplodeOptionsURL(ParticleBodyURL, ExplodeOptions):
 class ParticleOptionsURL(ParticleBodyURL, ParticleOptions):
     pass
 
+class DustOptionsURL(ParticleBodyURL, DustOptions):
+    pass
 
+class SandOptionsURL(ParticleBodyURL, SandOptions):
+    pass
 
 
+# fit_size arguments of the input of each effect
+EFFECT_FIT: dict[str, dict[str, int]] = {
+    'particles': {'width': 128, 'max_size': 600},
+    'explode': {'width': 80},
+    'dust': {'width': 128, 'max_size': 600},
+    'sand': {'width': 128, 'max_size': 600},
+}
+# (top, right, bottom, left)
+EXPLODE_PADDING = (40, 20, 0, 20)
+
+
+def grid_resample(sim_scale: int) -> typing.Optional[Image.Resampling]:
+    # a scaled output shows every cell as a block, so a cell is the mean of its source pixels
+    return Image.Resampling.BOX if sim_scale > 1 else None
+
+
+def scaled_cost(cost: float, sim_scale: int) -> float:
+    # the kernel runs at the usual size, encoding goes with the pixels of the output
+    return cost * sim_scale ** 2
+
+
+def particles_padding(skip: int, new_particles: int) -> tuple[int, int, int, int]:
+    # room above for the particles to spawn in
+    return 20 + skip * new_particles, 0, 0, 0
+
 
 @router.post('/particles')
 async def particles(request: Request, args: ParticleOptionsURL = Body(...)):
@@ -59,25 +112,30 @@ async def particles(request: Request, args: ParticleOptionsURL = Body(...)):
     skip = args.speed or 2
     new_particles = args.amount or 8
     particle_type = args.particle_type.value if args.particle_type else 0
+    fmt = animation_format(request, args.format)
 
     if not (0 < skip <= 10):
         raise ZNeitizException(400, 'speed must be an integer between 1 and 10.')
     if not (0 < new_particles <= 20):
         raise ZNeitizException(400, 'amount must be an integer between 1 and 25.')
 
-    im_bytes = await get_image_url(app, image_url)
+    im_bytes = await get_image_url(app, image_url, limits=IMAGE_LIMITS['particles'])
 
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            image = await _particles(
-                im,
-                num_frames=120,
-                new_particles=new_particles,
-                skip=skip,
-                particle_type=particle_type
-            )
+    cost = scaled_cost(image_cost('particles', im_bytes, **EFFECT_FIT['particles'], animated=False), args.sim_scale)
+    async with admit(request, 'particles', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                image = await _particles(
+                    im,
+                    num_frames=120,
+                    new_particles=new_particles,
+                    skip=skip,
+                    particle_type=particle_type,
+                    sim_scale=args.sim_scale,
+                    fmt=fmt
+                )
 
-    return Response(image.read(), media_type=f'image/gif')
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/particles/file')
@@ -89,46 +147,97 @@ async def particles_file(
     skip = args.speed or 2
     new_particles = args.amount or 8
     particle_type = args.particle_type.value if args.particle_type else 0
+    fmt = animation_format(request, args.format)
 
     if not (0 < skip <= 10):
         raise ZNeitizException(400, 'speed must be an integer between 1 and 10.')
     if not (0 < new_particles <= 20):
         raise ZNeitizException(400, 'amount must be an integer between 1 and 20.')
 
-    im_bytes = await get_upload_file(image)
+    im_bytes = await get_upload_file(image, limits=IMAGE_LIMITS['particles'])
+
+    cost = scaled_cost(image_cost('particles', im_bytes, **EFFECT_FIT['particles'], animated=False), args.sim_scale)
+    async with admit(request, 'particles', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                output = await _particles(
+                    im,
+                    num_frames=120,
+                    new_particles=new_particles,
+                    skip=skip,
+                    particle_type=particle_type,
+                    sim_scale=args.sim_scale,
+                    fmt=fmt
+                )
 
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            output = await _particles(
-                im,
-                num_frames=120,
-                new_particles=new_particles,
-                skip=skip,
-                particle_type=particle_type
-            )
+    return Response(output.read(), media_type=f'image/{fmt}')
 
-    return Response(output.read(), media_type=f'image/gif')
 
+def _on_white(images):
+    for frame in images:
+        im = Image.new('RGB', frame.size, (255, 255, 255))
+        im.paste(frame, mask=frame)
+        yield im
 
-@in_executor()
+
+@in_executor(process=True)
 def _particles(
     im: Image.Image,
     *,
     num_frames: int = 400,
     new_particles: int = 10,
     skip: int = 2,
-    particle_type: int = 0
+    particle_type: int = 0,
+    sim_scale: int = 1,
+    fmt: AnimationFormat = 'gif'
+) -> io.BytesIO:
+    with span('decode'):
+        size = fit_size(im.size, **EFFECT_FIT['particles'])
+        base = decode_rgba(im, size, pad=particles_padding(skip, new_particles), resample=grid_resample(sim_scale))
+    return render_particles.original(
+        base,
+        num_frames=num_frames,
+        new_particles=new_particles,
+        skip=skip,
+        particle_type=particle_type,
+        sim_scale=sim_scale,
+        fmt=fmt
+    )
+
+
+def _frame_images(frames: np.ndarray, sim_scale: int) -> typing.Iterator[Image.Image]:
+    # frames of the simulation grid, blown up to the output size while encoding
+    if sim_scale == 1:
+        return frame_images(frames)
+    return (Image.fromarray(frame) for frame in salt_ext.expand_frames(frames, sim_scale))
+
+
+def _save_frames(images: typing.Iterator[Image.Image], fmt: AnimationFormat, *, duration) -> io.BytesIO:
+    b = io.BytesIO()
+    with span('encode'):
+        if fmt == 'gif':
+            # frames erase pixels, which Pillow's encoder only gets right by storing them whole
+            save_gif(b, images, duration=duration)
+        else:
+            next(images).save(b, format=fmt, save_all=True, append_images=images, loop=0, duration=duration)
+    b.seek(0)
+    return b
+
+
+# the effects from a decoded and padded RGBA array to the encoded gif, the kernel and the
+# encoder run in the same worker so the frames never leave it
+
+@in_executor(process=True)
+def render_particles(
+    base: np.ndarray,
+    *,
+    num_frames: int = 400,
+    new_particles: int = 10,
+    skip: int = 2,
+    particle_type: int = 0,
+    sim_scale: int = 1,
+    fmt: AnimationFormat = 'gif'
 ) -> io.BytesIO:
-    w, h = im.size
-    if w != 128:
-        ratio = 128/w
-        im = im.resize((128, max(1, int(h*ratio))))
-    im = _limit_size(im, max_size=600)
-
-    im = im.convert('RGBA')
-    ref = np.zeros([20 + skip * new_particles, im.width, 4], dtype=np.uint8)
-    image = np.array(im)
-    base = np.vstack((ref, image))
     frames = salt_ext.draw_particles(
         base,
         frames=num_frames,
@@ -136,16 +245,38 @@ def _particles(
         skip=skip,
         particle_type=particle_type
     )
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
+    # converted while encoding, one frame at a time
+    images = _frame_images(frames, sim_scale)
     if particle_type == 1:
-        new_ims = [Image.new('RGB', im_frames[0].size, (255, 255, 255)) for _ in range(len(im_frames))]
-        for im, frame in zip(new_ims, im_frames):
-            im.paste(frame, mask=frame)
-        im_frames = new_ims
-    im_frames[0].save(b, format='gif', save_all=True, append_images=im_frames[1:], loop=0, dispose=2, duration=40)
-    b.seek(0)
-    return b
+        images = _on_white(images)
+    return _save_frames(images, fmt, duration=40)
+
+
+@in_executor(process=True)
+def render_explode(arr: np.ndarray, *, percent: int = 80, sim_scale: int = 1, fmt: AnimationFormat = 'gif') -> io.BytesIO:
+    im = next(_frame_images(arr[np.newaxis], sim_scale))
+    frames = salt_ext.draw_debris.original(arr, percent=percent)
+    duration = [500, *(30 for _ in range(len(frames)))]
+    return _save_frames(itertools.chain([im], _frame_images(frames, sim_scale)), fmt, duration=duration)
+
+
+def _render_falling(images: typing.Iterator[Image.Image], fmt: AnimationFormat) -> io.BytesIO:
+    return _save_frames(images, fmt, duration=30)
+
+
+@in_executor(process=True)
+def render_dust(arr: np.ndarray, *, fmt: AnimationFormat = 'gif', mode: salt_ext.DustMode = 'stepped') -> io.BytesIO:
+    """``arr`` padded with ``salt_ext.dust_padding``"""
+    if mode == 'closed':
+        # drawn while encoding, the frames are never all in memory
+        return _render_falling((Image.fromarray(frame) for frame in salt_ext.dust_frames(arr)), fmt)
+    return _render_falling(frame_images(salt_ext.draw_dust.original(arr)), fmt)
+
+
+@in_executor(process=True)
+def render_sand(arr: np.ndarray, *, sim_scale: int = 1, fmt: AnimationFormat = 'gif') -> io.BytesIO:
+    """``arr`` padded with ``salt_ext.crumble_padding``"""
+    return _render_falling(_frame_images(salt_ext.draw_crumble.original(arr), sim_scale), fmt)
 
 
 @router.post('/explode')
@@ -153,35 +284,27 @@ async def explode(request: Request, args: ExplodeOptionsURL = Body(...)):
     app = request.app
     image_url = args.image_url
     percent = args.percent or 80
+    fmt = animation_format(request, args.format)
 
     if not (0 < percent <= 100):
         raise ZNeitizException(400, 'percent must be an integer between 1 and 100')
 
-    im_bytes = await get_image_url(app, image_url)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 80:
-                ratio = 80/w
-                im = im.resize((80, max(1, int(h*ratio))))
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            side = np.zeros([arr.shape[0], 20, 4], dtype=np.uint8)
-            arr = np.hstack([side, arr, side])
-            arr = np.vstack([np.zeros([40, arr.shape[1], 4], dtype=np.uint8), arr])
-            im = Image.fromarray(arr)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-
-            frames = await salt_ext.draw_debris(arr, percent=percent)
+    im_bytes = await get_image_url(app, image_url, limits=IMAGE_LIMITS['explode'])
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    duration = [500, *(30 for _ in range(len(im_frames)))]
-    im.save(b, format='gif', save_all=True, append_images=im_frames, loop=0, dispose=2, duration=duration)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    cost = scaled_cost(image_cost('explode', im_bytes, **EFFECT_FIT['explode'], animated=False), args.sim_scale)
+    async with admit(request, 'explode', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    arr = decode_rgba(
+                        im, fit_size(im.size, **EFFECT_FIT['explode']), pad=EXPLODE_PADDING, resample=grid_resample(args.sim_scale)
+                    )
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_explode(arr, percent=percent, sim_scale=args.sim_scale, fmt=fmt)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/explode/file')
@@ -191,134 +314,118 @@ async def explode_file(
     args: ExplodeOptions = model_checker(ExplodeOptions)
 ):
     percent = args.percent or 80
+    fmt = animation_format(request, args.format)
 
     if not (0 < percent <= 100):
         raise ZNeitizException(400, 'percent must be an integer between 1 and 100')
 
-    im_bytes = await get_upload_file(image)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 80:
-                ratio = 80/w
-                im = im.resize((80, max(1, int(h*ratio))))
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            side = np.zeros([arr.shape[0], 20, 4], dtype=np.uint8)
-            arr = np.hstack([side, arr, side])
-            arr = np.vstack([np.zeros([40, arr.shape[1], 4], dtype=np.uint8), arr])
-            im = Image.fromarray(arr)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-
-            frames = await salt_ext.draw_debris(arr, percent=percent)
+    im_bytes = await get_upload_file(image, limits=IMAGE_LIMITS['explode'])
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    duration = [500, *(30 for _ in range(len(im_frames)))]
-    im.save(b, format='gif', save_all=True, append_images=im_frames, loop=0, dispose=2, duration=duration)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    cost = scaled_cost(image_cost('explode', im_bytes, **EFFECT_FIT['explode'], animated=False), args.sim_scale)
+    async with admit(request, 'explode', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    arr = decode_rgba(
+                        im, fit_size(im.size, **EFFECT_FIT['explode']), pad=EXPLODE_PADDING, resample=grid_resample(args.sim_scale)
+                    )
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_explode(arr, percent=percent, sim_scale=args.sim_scale, fmt=fmt)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/dust')
-async def dust(request: Request, args: ParticleBodyURL = Body(...)):
+async def dust(request: Request, args: DustOptionsURL = Body(...)):
     image_url = args.image_url
+    fmt = animation_format(request, args.format)
 
-    im_bytes = await get_image_url(request.app, image_url)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 128:
-                ratio = 128/w
-                im = im.resize((128, max(1, int(h*ratio))))
-            im = _limit_size(im, max_size=600)
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-            frames = await salt_ext.draw_dust(arr)
+    im_bytes = await get_image_url(request.app, image_url, limits=IMAGE_LIMITS['dust'])
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    im_frames[0].save(b, format='gif', save_all=True, append_images=im_frames[1:], loop=0, dispose=2, duration=30)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    cost = image_cost('dust', im_bytes, **EFFECT_FIT['dust'], animated=False)
+    async with admit(request, 'dust', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    w, h = fit_size(im.size, **EFFECT_FIT['dust'])
+                    arr = decode_rgba(im, (w, h), pad=salt_ext.dust_padding(h, w))
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_dust(arr, fmt=fmt, mode=args.mode)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/dust/file')
-async def dust_file(request: Request, image: UploadFile):
-
-    im_bytes = await get_upload_file(image)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 128:
-                ratio = 128/w
-                im = im.resize((128, max(1, int(h*ratio))))
-            im = _limit_size(im, max_size=600)
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-            frames = await salt_ext.draw_dust(arr)
+async def dust_file(
+    request: Request,
+    image: UploadFile,
+    args: DustOptions = model_checker(DustOptions, optional=True)
+):
+    fmt = animation_format(request, args.format)
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    im_frames[0].save(b, format='gif', save_all=True, append_images=im_frames[1:], loop=0, dispose=2, duration=30)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    im_bytes = await get_upload_file(image, limits=IMAGE_LIMITS['dust'])
+
+    cost = image_cost('dust', im_bytes, **EFFECT_FIT['dust'], animated=False)
+    async with admit(request, 'dust', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    w, h = fit_size(im.size, **EFFECT_FIT['dust'])
+                    arr = decode_rgba(im, (w, h), pad=salt_ext.dust_padding(h, w))
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_dust(arr, fmt=fmt, mode=args.mode)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/sand')
-async def sand(request: Request, args: ParticleBodyURL = Body(...)):
+async def sand(request: Request, args: SandOptionsURL = Body(...)):
     image_url = args.image_url
+    fmt = animation_format(request, args.format)
 
-    im_bytes = await get_image_url(request.app, image_url)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 128:
-                ratio = 128/w
-                im = im.resize((128, max(1, int(h*ratio))))
-            im = _limit_size(im, max_size=600)
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-            frames = await salt_ext.draw_crumble(arr)
+    im_bytes = await get_image_url(request.app, image_url, limits=IMAGE_LIMITS['sand'])
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    im_frames[0].save(b, format='gif', save_all=True, append_images=im_frames[1:], loop=0, dispose=2, duration=30)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    cost = scaled_cost(image_cost('sand', im_bytes, **EFFECT_FIT['sand'], animated=False), args.sim_scale)
+    async with admit(request, 'sand', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    w, h = fit_size(im.size, **EFFECT_FIT['sand'])
+                    arr = decode_rgba(im, (w, h), pad=salt_ext.crumble_padding(h, w), resample=grid_resample(args.sim_scale))
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_sand(arr, sim_scale=args.sim_scale, fmt=fmt)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
 
 
 @router.post('/sand/file')
-async def sand_file(request: Request, image: UploadFile):
-
-    im_bytes = await get_upload_file(image)
-
-    with io.BytesIO(im_bytes) as file:
-        with Image.open(file) as im:
-            w, h = im.size
-            if w != 128:
-                ratio = 128/w
-                im = im.resize((128, max(1, int(h*ratio))))
-            im = _limit_size(im, max_size=600)
-            im = im.convert('RGBA')
-            arr = np.array(im)
-            if not arr[..., 3].any():
-                raise ZNeitizException(400, 'Cannot be a blank image')
-            frames = await salt_ext.draw_crumble(arr)
+async def sand_file(
+    request: Request,
+    image: UploadFile,
+    args: SandOptions = model_checker(SandOptions, optional=True)
+):
+    fmt = animation_format(request, args.format)
 
-    b = io.BytesIO()
-    im_frames = [Image.fromarray(f) for f in frames]
-    im_frames[0].save(b, format='gif', save_all=True, append_images=im_frames[1:], loop=0, dispose=2, duration=30)
-    b.seek(0)
-    return Response(b.read(), media_type=f'image/gif')
+    im_bytes = await get_upload_file(image, limits=IMAGE_LIMITS['sand'])
+
+    cost = scaled_cost(image_cost('sand', im_bytes, **EFFECT_FIT['sand'], animated=False), args.sim_scale)
+    async with admit(request, 'sand', cost):
+        with io.BytesIO(im_bytes) as file:
+            with Image.open(file) as im:
+                with span('decode'):
+                    w, h = fit_size(im.size, **EFFECT_FIT['sand'])
+                    arr = decode_rgba(im, (w, h), pad=salt_ext.crumble_padding(h, w), resample=grid_resample(args.sim_scale))
+                if not arr[..., 3].any():
+                    raise ZNeitizException(400, 'Cannot be a blank image')
+
+        image = await render_sand(arr, sim_scale=args.sim_scale, fmt=fmt)
+
+    return Response(image.read(), media_type=f'image/{fmt}')
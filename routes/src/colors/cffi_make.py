@@ -3,7 +3,7 @@ import pathlib
 from cffi import FFI
 
 
-def build():
+def build(extra_compile_args=(), extra_link_args=()):
     ffibuilder = FFI()
 
     parent = pathlib.Path(__file__).parent.resolve()
@@ -12,10 +12,21 @@ def build():
     # specify its declaration here
     with open(f'{parent}/color_replace.h') as f:
         ffibuilder.cdef(f.read())
+    # defined below, which clone of the ISA_CLONES functions the loader picked
+    ffibuilder.cdef('const char *active_isa(void);')
 
     # Here go the sources, most likely only includes and additional functions if necessary
     ffibuilder.set_source("cffi_color_replace",
         """
         #include "color_replace.h"
-        """, sources=["color_replace.c"])
+        #include "isa.h"
+
+        const char *active_isa(void){
+            return isa_name();
+        }
+        """, sources=["color_replace.c"],
+        include_dirs=[str(parent.parent / 'common')],
+        # every ISA clone has to round the same, see common/isa.h
+        extra_compile_args=['-ffp-contract=off', *extra_compile_args],
+        extra_link_args=list(extra_link_args))
     ffibuilder.compile(str(parent))
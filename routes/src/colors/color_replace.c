@@ -4,12 +4,14 @@
 #include <math.h>
 
 #include "color_replace.h"
+#include "isa.h"
 
 #define M_PI        3.14159265358979323846264338327950288   /* pi */
 #define DZERO       0.00001 // zero for double compare
 #define NDZERO      -0.00001 // zero for double compare
 
 //Color math mumbo jumbo
+ISA_CLONES
 LAB get_RGB_to_LAB(double var_R, double var_G, double var_B){
     LAB c;
     // RGB to XYZ
@@ -97,6 +99,7 @@ double color_distance(double r1, double g1, double b1, double r2, double g2, dou
     return result;
 }
 
+ISA_CLONES
 double color_distance2000(double r1, double g1, double b1, double r2, double g2, double b2){
     // https://github.com/gfiumara/CIEDE2000
 
@@ -227,6 +230,213 @@ double color_distance2000(double r1, double g1, double b1, double r2, double g2,
     return deltaE;
 }
 
+ISA_CLONES
+double color_distance94(double r1, double g1, double b1, double r2, double g2, double b2){
+    // CIE94 with the graphic arts weights, the first color is the reference
+    LAB lab1 = get_RGB_to_LAB(r1, g1, b1);
+    LAB lab2 = get_RGB_to_LAB(r2, g2, b2);
+    double C1 = sqrt((lab1.a * lab1.a) + (lab1.b * lab1.b));
+    double C2 = sqrt((lab2.a * lab2.a) + (lab2.b * lab2.b));
+    double deltaL = lab1.L - lab2.L;
+    double deltaC = C1 - C2;
+    double deltaA = lab1.a - lab2.a;
+    double deltaB = lab1.b - lab2.b;
+    double deltaH2 = (deltaA * deltaA) + (deltaB * deltaB) - (deltaC * deltaC);
+    if (deltaH2 < 0){
+        // rounding, the hue difference is 0
+        deltaH2 = 0;
+    }
+    double S_C = 1.0 + (0.045 * C1);
+    double S_H = 1.0 + (0.015 * C1);
+    return sqrt((deltaL * deltaL) + ((deltaC / S_C) * (deltaC / S_C)) + (deltaH2 / (S_H * S_H)));
+}
+
+/*
+ * Approximations for color_distance2000_fast. The sRGB curve of 8 bit values comes from a
+ * table filled with the exact math, cbrt is two Halley steps from a bit trick, atan2 and
+ * sin are polynomials accurate to about 1e-5 and 1e-9. color_distance2000_fast_error is
+ * what that adds up to.
+ */
+const double color_distance2000_fast_error = 0.001;
+
+// sRGB to linear of every 8 bit value, times 100, the same math get_RGB_to_LAB does
+static double srgb_linear[256];
+
+__attribute__((constructor))
+static void init_srgb_linear(void){
+    for (int i = 0; i < 256; i++){
+        double v = i / 255.0;
+        if (v > 0.04045){
+            v = pow(((v + 0.055) / 1.055), 2.4);
+        }else{
+            v /= 12.92;
+        }
+        srgb_linear[i] = v * 100.0;
+    }
+}
+
+static inline double linear_fast(double v){
+    int i = (int)v;
+    if (i == v && i >= 0 && i <= 255){
+        return srgb_linear[i];
+    }
+    v /= 255.0;
+    return (v > 0.04045 ? pow(((v + 0.055) / 1.055), 2.4) : v / 12.92) * 100.0;
+}
+
+static inline double cbrt_fast(double x){
+    // a third of the exponent as the first guess, then two Halley steps
+    union { double d; unsigned long long u; } v = {x};
+    v.u = v.u / 3 + 0x2A9F7893782DA1CEULL;
+    double y = v.d, y3;
+    for (int i = 0; i < 2; i++){
+        y3 = y * y * y;
+        y = y * (y3 + 2.0 * x) / (2.0 * y3 + x);
+    }
+    return y;
+}
+
+static inline double lab_f_fast(double t){
+    return t > 0.008856 ? cbrt_fast(t) : (7.787 * t) + (16.0 / 116.0);
+}
+
+static inline LAB get_RGB_to_LAB_fast(double r, double g, double b){
+    LAB c;
+    double R = linear_fast(r), G = linear_fast(g), B = linear_fast(b);
+    double X = lab_f_fast((R * 0.4124 + G * 0.3576 + B * 0.1805) * (1.0 / 95.0489));
+    double Y = lab_f_fast((R * 0.2126 + G * 0.7152 + B * 0.0722) * (1.0 / 100.0));
+    double Z = lab_f_fast((R * 0.0193 + G * 0.1192 + B * 0.9505) * (1.0 / 108.8840));
+    c.L = (116.0 * Y) - 16.0;
+    c.a = 500.0 * (X - Y);
+    c.b = 200.0 * (Y - Z);
+    return c;
+}
+
+static inline double atan2_fast(double y, double x){
+    // not for x == y == 0
+    double ax = fabs(x), ay = fabs(y);
+    int steep = ay > ax;
+    double z = steep ? ax / ay : ay / ax, z2 = z * z;
+    double r = z * (0.99997726 + z2 * (-0.33262347 + z2 * (0.19354346 +
+        z2 * (-0.11643287 + z2 * (0.05265332 + z2 * -0.01172120)))));
+    r = steep ? (M_PI / 2.0) - r : r;
+    r = x < 0 ? M_PI - r : r;
+    return copysign(r, y);
+}
+
+static inline double hue_fast(double b, double aPrime){
+    if (b == 0 && aPrime == 0){
+        return 0.0;
+    }
+    double h = atan2_fast(b, aPrime);
+    return h < 0 ? h + (2.0 * M_PI) : h;
+}
+
+static inline double sin_fast(double x){
+    // only for |x| <= pi/2
+    double x2 = x * x;
+    return x * (1.0 + x2 * (-1.0 / 6.0 + x2 * (1.0 / 120.0 + x2 * (-1.0 / 5040.0 +
+        x2 * (1.0 / 362880.0 + x2 * (-1.0 / 39916800.0))))));
+}
+
+ISA_CLONES
+double color_distance2000_fast(double r1, double g1, double b1, double r2, double g2, double b2){
+    /*
+     * color_distance2000 without most of its trig. sqrt(C'1 C'2) sin(dh'/2) is worked out
+     * from the dot and cross product of (a', b') of both colors, and the mean hue is the
+     * direction of the sum of both unit hue vectors, so its sin/cos are just that vector.
+     * One atan2 is left for the blue term.
+     */
+    LAB lab1 = get_RGB_to_LAB_fast(r1, g1, b1);
+    LAB lab2 = get_RGB_to_LAB_fast(r2, g2, b2);
+    double pow25To7 = 6103515625.0; /* pow(25, 7) */
+
+    double C1 = sqrt((lab1.a * lab1.a) + (lab1.b * lab1.b));
+    double C2 = sqrt((lab2.a * lab2.a) + (lab2.b * lab2.b));
+    double barC = (C1 + C2) / 2.0;
+    double barC2 = barC * barC;
+    double barC7 = barC2 * barC2 * barC2 * barC;
+    double G = 0.5 * (1 - sqrt(barC7 / (barC7 + pow25To7)));
+    double a1Prime = (1.0 + G) * lab1.a;
+    double a2Prime = (1.0 + G) * lab2.a;
+    double CPrime1 = sqrt((a1Prime * a1Prime) + (lab1.b * lab1.b));
+    double CPrime2 = sqrt((a2Prime * a2Prime) + (lab2.b * lab2.b));
+    double CPrimeProduct = CPrime1 * CPrime2;
+
+    double deltaLPrime = lab2.L - lab1.L;
+    double deltaCPrime = CPrime2 - CPrime1;
+    // 4 C'1 C'2 sin(dh'/2)^2 = 2 (C'1 C'2 - dot), the sign of dh' is the one of the cross product
+    double dot = (a1Prime * a2Prime) + (lab1.b * lab2.b);
+    double cross = (a1Prime * lab2.b) - (a2Prime * lab1.b);
+    double deltaH2 = 2.0 * (CPrimeProduct - dot);
+    double deltaHPrime = copysign(sqrt(deltaH2 > 0 ? deltaH2 : 0), cross);
+
+    double barLPrime = (lab1.L + lab2.L) / 2.0;
+    double barCPrime = (CPrime1 + CPrime2) / 2.0;
+    // a color without chroma has hue 0, the mean hue is then the hue of the other one
+    double x = 1.0, y = 0;
+    if (CPrimeProduct != 0){
+        double inv1 = 1.0 / CPrime1, inv2 = 1.0 / CPrime2;
+        x = (a1Prime * inv1) + (a2Prime * inv2);
+        y = (lab1.b * inv1) + (lab2.b * inv2);
+    }else if (CPrime1 != 0 || CPrime2 != 0){
+        x = a1Prime + a2Prime;
+        y = lab1.b + lab2.b;
+    }
+    double norm = sqrt((x * x) + (y * y));
+    if (norm < 1e-9){
+        // opposite hues, the mean of the two hue angles like color_distance2000
+        double h = hue_fast(lab1.b, a1Prime) + hue_fast(lab2.b, a2Prime);
+        x = cos(h / 2.0);
+        y = sin(h / 2.0);
+        norm = 1.0;
+    }
+    double c1 = x * (1.0 / norm), s1 = y * (1.0 / norm);
+    double barhPrime = hue_fast(s1, c1);
+
+    // the four cosines of T by the multiple angle formulas
+    double c2 = (2.0 * c1 * c1) - 1.0, s2 = 2.0 * s1 * c1;
+    double c3 = c1 * ((4.0 * c1 * c1) - 3.0), s3 = s1 * (3.0 - (4.0 * s1 * s1));
+    double c4 = (2.0 * c2 * c2) - 1.0, s4 = 2.0 * s2 * c2;
+    double T = 1.0 -
+        (0.17 * ((c1 * 0.86602540378443864676) + (s1 * 0.5))) +   /* cos(h - 30) */
+        (0.24 * c2) +
+        (0.32 * ((c3 * 0.99452189536827333692) - (s3 * 0.10452846326765347140))) -   /* cos(3h + 6) */
+        (0.20 * ((c4 * 0.45399049973954679156) + (s4 * 0.89100652418836786236)));   /* cos(4h - 63) */
+    double theta = (barhPrime - deg2Rad(275.0)) / deg2Rad(25.0);
+    double deltaTheta = deg2Rad(30.0) * exp(-(theta * theta));
+    double barCPrime2 = barCPrime * barCPrime;
+    double barCPrime7 = barCPrime2 * barCPrime2 * barCPrime2 * barCPrime;
+    double R_C = 2.0 * sqrt(barCPrime7 / (barCPrime7 + pow25To7));
+    double L50 = (barLPrime - 50.0) * (barLPrime - 50.0);
+    double S_L = 1 + ((0.015 * L50) / sqrt(20 + L50));
+    double S_C = 1 + (0.045 * barCPrime);
+    double S_H = 1 + (0.015 * barCPrime * T);
+    double R_T = -sin_fast(2.0 * deltaTheta) * R_C;
+
+    double dL = deltaLPrime / S_L, dC = deltaCPrime / S_C, dH = deltaHPrime / S_H;
+    return sqrt((dL * dL) + (dC * dC) + (dH * dH) + (R_T * dC * dH));
+}
+
+typedef double (*DistanceFunction)(double, double, double, double, double, double);
+
+static DistanceFunction metric_function(int metric){
+    switch (metric){
+    case METRIC_CIE76:
+        return color_distance;
+    case METRIC_CIE94:
+        return color_distance94;
+    case METRIC_CIE2000_FAST:
+        return color_distance2000_fast;
+    default:
+        return color_distance2000;
+    }
+}
+
+double metric_distance(int metric, double r1, double g1, double b1, double r2, double g2, double b2){
+    return metric_function(metric)(r1, g1, b1, r2, g2, b2);
+}
+
 char get_rand(){
     return (unsigned char) (rand() % 255);
 }
@@ -415,13 +625,14 @@ RGB offset_rgb2(
     return ret;
 }
 
-void* random_colors(double input[], int len, double max_dist, char output[], Replaced *colors, int* current_index, int*current_size){
+void* random_colors(double input[], int len, double max_dist, int metric, char output[], Replaced *colors, int* current_index, int*current_size){
     //check if multiple of 3
     if (len % 3 != 0){
         return NULL;
     }
     Replaced var;
     void * temp;
+    DistanceFunction distance = metric_function(metric);
 
     //printf("C %d %d %d, %d %d\n", colors[0].r, colors[0].g, colors[0].b, *current_index, *current_size);
     int min_index;
@@ -438,7 +649,7 @@ void* random_colors(double input[], int len, double max_dist, char output[], Rep
                 // if any replaced colors, check distance
                 for (int j=0; j< *current_index; j++){
                     //loop over replaced colors
-                    dist = color_distance2000(r,g,b, colors[j].or, colors[j].og, colors[j].ob);
+                    dist = distance(r,g,b, colors[j].or, colors[j].og, colors[j].ob);
                     if (dist < 0.1){
                         //close enough to the same color, replace
                         min_index = j;
@@ -528,134 +739,124 @@ unsigned char offset_rgb(unsigned char value, char offset){
         return value;
     }
 }*/
-ReplacedColors replace_colors(double input[], int len, double max_dist, unsigned char output[], ReplacedColors all_colors, ToReplace other_colors){
-    //check if multiple of 3
-    if (len % 3 != 0){
-        return all_colors;
-    }
+
+static double stat_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * input/output are `count` RGB colors, `in_stride`/`out_stride` bytes apart, so numpy
+ * palettes and pixel buffers can be passed without copying.
+ * all_colors/other_colors are owned by the caller and carry state between calls.
+ * metric is one of ColorMetric, max_dist is in its units.
+ * stats can be NULL.
+ * returns 0, or -1 if growing all_colors failed (all_colors is left as it was)
+ */
+ISA_CLONES
+int replace_colors(const unsigned char input[], int count, int in_stride, double max_dist, int metric,
+                   unsigned char output[], int out_stride,
+                   ReplacedColors *all_colors, ToReplace *other_colors, ColorStats *stats){
+    int ret = 0;
+    unsigned long long evals = 0, reallocs = 0;
+    double start = stats ? stat_clock() : 0;
+    DistanceFunction distance = metric_function(metric);
     RGB offset;
-    Replaced var;
-    void * temp;
+    Replaced *colors, *temp;
 
-    //printf("C , %d %d\n", all_colors.current, all_colors.size);
+    //printf("C , %d %d\n", all_colors->current, all_colors->size);
     int min_index;
     double dist, min_dist, r,g,b;
-    for (int i=0; i<len; i+=3){
+    const unsigned char *in;
+    unsigned char *out;
+    for (int i=0; i<count; i++){
+        in = input + (size_t)i * in_stride;
+        out = output + (size_t)i * out_stride;
         min_dist = 512;
         min_index = -1;
         // for each 3 rgb values
-        r = input[i];
-        g = input[i+1];
-        b = input[i+2];
-        if (r+g+b > 0.0){
-            if (all_colors.current > 0){
-                // if any replaced colors, check distance
-                for (int j=0; j< all_colors.current; j++){
-                    //loop over replaced colors
-                    dist = color_distance2000(
-                        all_colors.colors[j].or, all_colors.colors[j].og, all_colors.colors[j].ob,
-                        r,g,b
-                    );
-                    if (dist < 0.1){
-                        //close enough to the same color, replace
-                        min_index = j;
-                        break;
-                    }else if (dist < min_dist && dist < max_dist){
-                        min_dist = dist;
-                        min_index = j;
-                    }
-                }
-                if (min_index >= 0){
-                    //found a matching colors, calc for offset
-
-                    offset = offset_rgb2(
-                        all_colors.colors[min_index].or, all_colors.colors[min_index].og, all_colors.colors[min_index].ob,
-                        r, g, b,
-                        all_colors.colors[min_index].r, all_colors.colors[min_index].g, all_colors.colors[min_index].b
-                    );
-                    output[i] = (unsigned char)offset.r;
-                    output[i+1] = (unsigned char)offset.g;
-                    output[i+2] = (unsigned char)offset.b;
-                    /*
-                    output[i] = offset_rgb(all_colors.colors[min_index].r, r-all_colors.colors[min_index].or);
-                    output[i+1] = offset_rgb(all_colors.colors[min_index].g, g-all_colors.colors[min_index].og);
-                    output[i+2] = offset_rgb(all_colors.colors[min_index].b, b-all_colors.colors[min_index].ob);
-                    */
-                }else{
-                    //no color found, get next color
-                    if (*(other_colors.current) >= other_colors.size){
-                        *other_colors.current = 0;
-                    }
-                    output[i] = (unsigned char) other_colors.colors[(*other_colors.current)++];
-                    output[i+1] = (unsigned char) other_colors.colors[(*other_colors.current)++];
-                    output[i+2] = (unsigned char) other_colors.colors[(*other_colors.current)++];
-
-
-                    //add color to replaced colors
-                    //set original color
-                    all_colors.colors[all_colors.current].or = r;
-                    all_colors.colors[all_colors.current].og = g;
-                    all_colors.colors[all_colors.current].ob = b;
-                    //set replaced color
-                    all_colors.colors[all_colors.current].r = output[i];
-                    all_colors.colors[all_colors.current].g = output[i+1];
-                    all_colors.colors[all_colors.current].b = output[i+2];
-                    //increment current index
-                    all_colors.current++;
-                    //check if need to realloc
-                    if (all_colors.current >= all_colors.size){
-                        all_colors.size += 20;
-                        //printf("realloc1 size, %d  index %d\n", all_colors.size, all_colors.current);
-                        temp = realloc(all_colors.colors, sizeof(var)*(all_colors.size));
-                        if (temp == NULL){
-                            free(all_colors.colors);
-                            return all_colors;
-                        }
-                        all_colors.colors = temp;
-                    }
-                }
-            }else{
-                //no previous colors, get next color
-                if (*(other_colors.current) >= other_colors.size){
-                    *other_colors.current = 0;
-                }
-                output[i] = (char) other_colors.colors[(*other_colors.current)++];
-                output[i+1] = (char) other_colors.colors[(*other_colors.current)++];
-                output[i+2] = (char) other_colors.colors[(*other_colors.current)++];
-
-
-                //add color to replaced colors
-                //set original color
-                all_colors.colors[all_colors.current].or = r;
-                all_colors.colors[all_colors.current].og = g;
-                all_colors.colors[all_colors.current].ob = b;
-                //set replaced color
-                all_colors.colors[all_colors.current].r = output[i];
-                all_colors.colors[all_colors.current].g = output[i+1];
-                all_colors.colors[all_colors.current].b = output[i+2];
-                //increment current index
-                all_colors.current++;
-                //check if need to realloc
-                if (all_colors.current >= all_colors.size){
-                    all_colors.size += 20;
-                    //printf("realloc2 size, %d  index %d\n", all_colors.size, all_colors.current);
-                    temp = realloc(all_colors.colors, sizeof(var)*(all_colors.size));
-                    if (temp == NULL){
-                        free(all_colors.colors);
-                        return all_colors;
-                    }
-                    all_colors.colors = temp;
-                }
-            }
-        }else{
+        r = in[0];
+        g = in[1];
+        b = in[2];
+        if (r+g+b <= 0.0){
             //sum is < threshold, use original color
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+            continue;
+        }
+        colors = all_colors->colors;
+        // if any replaced colors, check distance
+        for (int j=0; j< all_colors->current; j++){
+            //loop over replaced colors
+            evals++;
+            dist = distance(
+                colors[j].or, colors[j].og, colors[j].ob,
+                r,g,b
+            );
+            if (dist < 0.1){
+                //close enough to the same color, replace
+                min_index = j;
+                break;
+            }else if (dist < min_dist && dist < max_dist){
+                min_dist = dist;
+                min_index = j;
+            }
+        }
+        if (min_index >= 0){
+            //found a matching colors, calc for offset
+            offset = offset_rgb2(
+                colors[min_index].or, colors[min_index].og, colors[min_index].ob,
+                r, g, b,
+                colors[min_index].r, colors[min_index].g, colors[min_index].b
+            );
+            out[0] = (unsigned char)offset.r;
+            out[1] = (unsigned char)offset.g;
+            out[2] = (unsigned char)offset.b;
+            continue;
+        }
 
-            output[i] = (char)r;
-            output[i+1] = (char)g;
-            output[i+2] = (char)b;
+        //no color found, get next color
+        if (other_colors->current >= other_colors->size){
+            other_colors->current = 0;
         }
+        out[0] = other_colors->colors[other_colors->current++];
+        out[1] = other_colors->colors[other_colors->current++];
+        out[2] = other_colors->colors[other_colors->current++];
+
+        //add color to replaced colors
+        //set original color
+        colors[all_colors->current].or = r;
+        colors[all_colors->current].og = g;
+        colors[all_colors->current].ob = b;
+        //set replaced color
+        colors[all_colors->current].r = out[0];
+        colors[all_colors->current].g = out[1];
+        colors[all_colors->current].b = out[2];
+        //increment current index
+        all_colors->current++;
+        //check if need to realloc, doubling keeps big palettes at a few reallocs
+        if (all_colors->current >= all_colors->size){
+            //printf("realloc size, %d  index %d\n", all_colors->size, all_colors->current);
+            temp = realloc(colors, sizeof(Replaced)*(all_colors->size * 2));
+            reallocs++;
+            if (temp == NULL){
+                all_colors->current--;
+                ret = -1;
+                break;
+            }
+            all_colors->colors = temp;
+            all_colors->size *= 2;
+        }
+    }
+    if (stats){
+        stats->colors_in += count;
+        stats->distance_evals += evals;
+        stats->table_reallocs += reallocs;
+        stats->replace_seconds += stat_clock() - start;
     }
-    return all_colors;
+    return ret;
 }
 
 void free_ptr(void * ptr){
@@ -26,19 +26,43 @@ struct replaced_colors{
 typedef struct replaced_colors ReplacedColors;
 
 struct to_replace{
-    int* current;
-    int size;
-    char* colors;
+    const unsigned char* colors;
+    int size, current;
 };
 typedef struct to_replace ToReplace;
 
+// optional work counters for replace_colors, added to on every call
+struct color_stats{
+    unsigned long long colors_in;
+    unsigned long long distance_evals;
+    unsigned long long table_reallocs;
+    double replace_seconds;
+};
+typedef struct color_stats ColorStats;
+
+// color difference formula of replace_colors and random_colors, anything else is CIE2000
+enum color_metric{
+    METRIC_CIE2000 = 0,
+    METRIC_CIE76 = 1,
+    METRIC_CIE94 = 2,
+    // CIEDE2000 with polynomial trig/exp and a table for the sRGB curve
+    METRIC_CIE2000_FAST = 3,
+};
+typedef enum color_metric ColorMetric;
+
+// most color_distance2000_fast is ever off from color_distance2000, checked by python -m bench.native --sweep
+extern const double color_distance2000_fast_error;
+
 LAB get_RGB_to_LAB(double, double, double);
 double color_distance(double, double, double, double, double, double);
 double color_distance2000(double, double, double, double, double, double);
+double color_distance94(double, double, double, double, double, double);
+double color_distance2000_fast(double, double, double, double, double, double);
+double metric_distance(int, double, double, double, double, double, double);
 RGB offset_rgb2(double, double, double, double, double, double, double, double, double);
 double deg2Rad(double);
 double rad2Deg(double);
-void* random_colors(double[], int, double, char[], Replaced *, int* , int*);
-ReplacedColors replace_colors(double[], int, double, unsigned char[], ReplacedColors, ToReplace);
+void* random_colors(double[], int, double, int, char[], Replaced *, int* , int*);
+int replace_colors(const unsigned char[], int, int, double, int, unsigned char[], int, ReplacedColors *, ToReplace *, ColorStats *);
 void* create_ptr(int, int);
 void free_ptr(void *);
@@ -1,15 +1,99 @@
 import io
-import sys
+import zlib
 import typing
+import hashlib
 
-from PIL import Image, ImageSequence
+import numpy as np
+from PIL import Image
 
 from .cffi_color_replace import ffi, lib
-from ...utils.img_utils import _limit_size
-from ...utils.function_utils import in_executor
+from ...utils.img_utils import fit_size, decode_reduced, iter_frames
+from ...utils.img_header import probe_header, count_frames, palette_tables
+from ...utils.function_utils import in_executor, AnimationFormat
+from ...utils.metrics import span, add_info, add_counters, current_timer
+from ...utils.pipeline import pipeline
 
 SIZE = 40
 
+# max_distance is in the units of the metric, CIE76/CIE94 are cheaper than CIEDE2000 and
+# cie2000_fast stays within lib.color_distance2000_fast_error of it
+ColorMetric = typing.Literal['cie76', 'cie94', 'cie2000', 'cie2000_fast']
+METRICS: dict[str, int] = {
+    'cie76': lib.METRIC_CIE76,
+    'cie94': lib.METRIC_CIE94,
+    'cie2000': lib.METRIC_CIE2000,
+    'cie2000_fast': lib.METRIC_CIE2000_FAST,
+}
+
+
+def active_isa() -> str:
+    """The instruction set the multiversioned kernels run with, picked at import."""
+    return ffi.string(lib.active_isa()).decode()
+
+
+def _buffer(arr: np.ndarray):
+    # zero-copy pointer into a numpy array, strided views are passed by their first element
+    if arr.flags.c_contiguous:
+        return ffi.from_buffer('unsigned char []', arr)
+    return ffi.cast('unsigned char *', arr.ctypes.data)
+
+
+class ColorTable:
+    """C side state of one recolor: the table of already replaced colors and the
+    position in the replacement colors. Created once per request and shared by every frame
+    so one color maps to the same replacement throughout an animation."""
+
+    def __init__(self, replace_colors: list, metric: ColorMetric = 'cie2000'):
+        self.metric = METRICS[metric]
+        self._replace = np.array(replace_colors, dtype=np.uint8)
+        self._replace_buffer = ffi.from_buffer('unsigned char []', self._replace)
+
+        self.other_colors = ffi.new('ToReplace *')
+        self.other_colors.colors = self._replace_buffer
+        self.other_colors.size = len(self._replace)
+        self.other_colors.current = 0
+
+        self.colors = ffi.new('ReplacedColors *')
+        self.colors.colors = lib.create_ptr(SIZE, 1)
+        self.colors.current = 0
+        self.colors.size = 1
+
+        # only count inside a request
+        self.stats = ffi.new('ColorStats *') if current_timer() is not None else ffi.NULL
+
+    def replace(self, palette: np.ndarray, max_dist: float) -> np.ndarray:
+        """Replace an (n, >=3) uint8 array of colors, returns a new (n, 3) array."""
+        output = np.zeros([len(palette), 3], dtype=np.uint8)
+        with span('kernel'):
+            failed = lib.replace_colors(
+                _buffer(palette), len(palette), palette.strides[0], max_dist, self.metric,
+                _buffer(output), output.strides[0],
+                self.colors, self.other_colors, self.stats
+            )
+        if failed:
+            raise MemoryError('Could not grow replaced colors table')
+        return output
+
+    def close(self):
+        add_info(replaced_colors=self.colors.current, table_size=self.colors.size)
+        if self.stats != ffi.NULL:
+            stats, self.stats = self.stats, ffi.NULL
+            add_counters({
+                'colors_in': stats.colors_in,
+                'distance_evals': stats.distance_evals,
+                'table_reallocs': stats.table_reallocs,
+                'replace_seconds': stats.replace_seconds,
+            })
+        if self.colors.colors != ffi.NULL:
+            lib.free_ptr(self.colors.colors)
+            self.colors.colors = ffi.NULL
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
 
 def color_distance(color1, color2) -> float:
     return lib.color_distance(*[float(i) for i in color1], *[float(i) for i in color2])
@@ -19,56 +103,25 @@ def color_distance2000(color1, color2) -> float:
     return lib.color_distance2000(*[float(i) for i in color1], *[float(i) for i in color2])
 
 
+def metric_distance(color1, color2, metric: ColorMetric = 'cie2000') -> float:
+    return lib.metric_distance(METRICS[metric], *[float(i) for i in color1], *[float(i) for i in color2])
+
+
 def shift_color(ref, offset, rgb) -> tuple[int, int, int]:
     color = lib.offset_rgb2(*(float(i) for i in (*ref, *offset, *rgb)))
     return (color.r, color.g, color.b)
 
 
-@in_executor()
-def replace_gif_colors(
-    image: Image.Image,
-    replace_colors: list,
-    max_dist: float = 12.0,
-    mode: int = 2,
-    *,
-    newsize: int = 512
-):
-    max_dist = float(max_dist)
+def _check_colors(replace_colors: list):
     if not replace_colors or len(replace_colors) % 3 != 0 or any(not 0<=x<=255 for x in replace_colors):
         raise ValueError('replace_colors should be tuple/list of int, values between 0-255')
-    lc = len(replace_colors)//3
-
-    other_colorsp = ffi.new("ToReplace*")
-    cp = ffi.new("int *", 0)
-    other_colorsp.current = cp
-    other_colorsp.size = len(replace_colors)
-
-    colorsp = ffi.new('char []', [_.to_bytes(1, sys.byteorder) for _ in replace_colors])
-    other_colorsp.colors = colorsp
-
-    other_colors = other_colorsp[0]
 
-    ccolors = lib.create_ptr(SIZE, 1)
 
-    colors_ptrp = ffi.new('ReplacedColors*')
-    colors_ptrp.colors = ccolors
-    colors_ptrp.current = 0
-    colors_ptrp.size = 1
-
-    colors_ptr = colors_ptrp[0]
-
-    palette_len = 768
-    max_dist = max_dist
-
-    frames = []
-    duration = []
-    for im in ImageSequence.Iterator(image):
-        raw_ret = (b'\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00'*64)
-        ret = ffi.new('char []', raw_ret)
-
-        duration.append(im.info.get('duration', 40))
-        original_size = im.size
-        im = im.resize((im.width * 2, im.height * 2))
+def _replace_frame(
+    im: Image.Image, table: ColorTable, lc: int, max_dist: float, mode: int
+) -> tuple[Image.Image, np.ndarray]:
+    """Recolored RGBA frame and the (n, 3) colors it was recolored with."""
+    with span('quantize'):
         original_alpha = im.convert('RGBA').getchannel('A')
         try:
             im = im.convert('RGB')
@@ -78,142 +131,402 @@ def replace_gif_colors(
             im = im.quantize(lc, method=mode, dither=Image.NONE)
         palette, mapping = sort_palette(im)
 
-        input_colors = ffi.new('double []', [float(x) for x in palette])
-
-        colors_ptr = lib.replace_colors(input_colors, palette_len, max_dist, ret, colors_ptr, other_colors)
-        palette = [int.from_bytes(x, sys.byteorder) for x in ret]
-        new_palette = [0] * 768
-        for i, index in enumerate(mapping):
-            new_palette[index*3:index*3+3] = palette[i*3:i*3+3]
-
-        im.putpalette(new_palette)
-        im.info.pop('transparency', None)
-        im = im.convert('RGBA')
-        im.putalpha(original_alpha)
-        if newsize:
-            im = _limit_size(im.resize(original_size), max_size=newsize)
-        frames.append(im.quantize(256, dither=Image.NONE))
-    lib.free_ptr(colors_ptr.colors)
-    return frames_to_image(frames, duration)
+    replaced = table.replace(palette[:len(mapping)], max_dist)
+    new_palette = np.zeros([256, 3], dtype=np.uint8)
+    new_palette[mapping] = replaced
 
+    im.putpalette(new_palette.tobytes())
+    im.info.pop('transparency', None)
+    im = im.convert('RGBA')
+    im.putalpha(original_alpha)
+    return im, replaced
+
+
+def _frame_key(im: Image.Image) -> bytes:
+    """Hash of what a decoded frame shows. Gif frames that look the same can differ in mode
+    and in the color under transparent pixels, neither counts."""
+    arr = np.array(im.convert('RGBA'))
+    arr[arr[..., 3] == 0] = 0
+    h = hashlib.blake2b(arr.tobytes(), digest_size=16)
+    h.update(str(arr.shape).encode())
+    return h.digest()
+
+
+def _rgb555(rgba: np.ndarray) -> np.ndarray:
+    rgb = rgba[..., :3] >> 3
+    return (rgb[..., 0].astype(np.uint16) << 10) | (rgb[..., 1].astype(np.uint16) << 5) | rgb[..., 2]
+
+
+def _nearest(colors: np.ndarray, palette: np.ndarray) -> tuple[np.ndarray, np.ndarray]:
+    """Index of the nearest ``palette`` color of every color and its squared distance."""
+    index = np.zeros(len(colors), dtype=np.uint8)
+    dist = np.zeros(len(colors), dtype=np.int32)
+    palette = palette.astype(np.int32)
+    for start in range(0, len(colors), 4096):
+        diff = colors[start:start+4096, None, :].astype(np.int32) - palette[None, :, :]
+        d = (diff * diff).sum(axis=2)
+        index[start:start+4096] = np.argmin(d, axis=1)
+        dist[start:start+4096] = d.min(axis=1)
+    return index, dist
+
+
+class GlobalPalette:
+    """One gif palette for every frame of a recolor, gathered from the frames as they come.
+    A frame is kept as its 15 bit RGB, half of its RGBA, until the palette is known, so unlike
+    the apng path a gif holds every unique frame at once: up to ``max_frames`` of 2 bytes a
+    pixel, ~100MB at the 200 frames of 512x512 of the defaults.
+
+    The palette is the assigned colors, the free entries go to the most used colors
+    resizing blended in between them, and one is transparent.
+    """
+
+    TRANSPARENT = 1 << 15
+
+    def __init__(self):
+        self.sums = np.zeros([1 << 15, 3], dtype=np.float64)
+        self.counts = np.zeros(1 << 15, dtype=np.int64)
+        self.assigned = []
+        # frame key -> 15 bit colors, TRANSPARENT where the frame is
+        self.frames: dict[bytes, np.ndarray] = {}
+
+    def add(self, key: bytes, frame: Image.Image, colors: np.ndarray):
+        arr = np.asarray(frame)
+        rgb = _rgb555(arr)
+        # gif transparency is on or off
+        opaque = arr[..., 3] >= 128
+        keys = rgb[opaque]
+        self.counts += np.bincount(keys, minlength=1 << 15)
+        for c in range(3):
+            self.sums[:, c] += np.bincount(keys, weights=arr[..., c][opaque], minlength=1 << 15)
+        rgb[~opaque] = self.TRANSPARENT
+        self.frames[key] = rgb
+        self.assigned.append(colors)
+
+    def images(self, keys: list[bytes]) -> tuple[list[Image.Image], typing.Optional[bytes], typing.Optional[int]]:
+        """P images of the frames ``keys``, the palette and its transparent index. When the
+        assigned colors don't fit in one palette, every frame is quantized to its own and
+        there is no global one."""
+        # only the 15 bit colors that are in the frames, usually a few thousand of 32768
+        present = np.flatnonzero(self.counts)
+        counts = self.counts[present]
+        means = np.rint(self.sums[present] / counts[:, None]).astype(np.uint8)
+        colors = np.unique(np.concatenate(self.assigned).reshape(-1, 3), axis=0)
+        if len(colors) > 255:
+            add_info(global_palette=False)
+            return self._quantized(keys, present, means), None, None
+
+        free = 255 - len(colors)
+        if free and len(means):
+            _, dist = _nearest(means, colors)
+            # a blend is only worth an entry when it's visibly off every assigned color
+            by_use = np.argsort(-counts, kind='stable')
+            far = by_use[dist[by_use] > 3 * 12 * 12]
+            colors = np.unique(np.vstack([colors, means[far[:free]]]), axis=0)
+
+        transparent = len(colors)
+        # a color of its own, the encoder matches frame palettes by color
+        used = {tuple(c) for c in colors.tolist()}
+        filler = next((i, i, 255 - i) for i in range(256) if (i, i, 255 - i) not in used)
+        palette = np.vstack([colors, np.array([filler], dtype=np.uint8)]).tobytes()
+
+        lut = np.zeros(self.TRANSPARENT + 1, dtype=np.uint8)
+        lut[present], _ = _nearest(means, colors)
+        lut[self.TRANSPARENT] = transparent
+
+        mapped = {}
+        for key, rgb in self.frames.items():
+            mapped[key] = Image.fromarray(lut[rgb], mode='P')
+            mapped[key].putpalette(palette)
+        self.frames.clear()
+        add_info(global_palette=True)
+        return [mapped[key] for key in keys], palette, transparent
+
+    def _quantized(self, keys: list[bytes], present: np.ndarray, means: np.ndarray) -> list[Image.Image]:
+        # the frames back from the mean color of each of their 15 bit colors
+        rgba = np.zeros([self.TRANSPARENT + 1, 4], dtype=np.uint8)
+        rgba[present, :3] = means
+        rgba[present, 3] = 255
+        quantized = {}
+        for key, rgb in self.frames.items():
+            quantized[key] = Image.fromarray(rgba[rgb], mode='RGBA').quantize(256, dither=Image.NONE)
+        self.frames.clear()
+        return [quantized[key] for key in keys]
+
+
+def _decode_frames(image: Image.Image, newsize: int, max_frames: int):
+    """Decode stage: (key, frame at 2x of its output size or None when it was seen before,
+    output size, duration). Holds are merged into one item."""
+    seen = set()
+    pending = None
+    merged = 0
+    for im, frame_duration in iter_frames(image, max_frames=max_frames):
+        with span('dedup'):
+            key = _frame_key(im)
+        if pending is not None and key == pending[0]:
+            # a hold, shown once for both durations
+            pending[3] += frame_duration
+            merged += 1
+            continue
+        if pending is not None:
+            yield tuple(pending)
+
+        if key in seen:
+            pending = [key, None, None, frame_duration]
+            continue
+        seen.add(key)
+        # work at 2x of the capped output size, never at 2x of a huge input
+        original_size = fit_size(im.size, max_size=newsize)
+        with span('decode'):
+            frame = decode_reduced(im, (original_size[0] * 2, original_size[1] * 2))
+            # the sequence seeks the same image to the next frame
+            if frame is im:
+                frame = im.copy()
+        pending = [key, frame, original_size, frame_duration]
+    if pending is not None:
+        yield tuple(pending)
+    add_counters({'dedup_merged': merged})
+
+
+def _recolor_frames(items, replace_colors: list, lc: int, max_dist: float, mode: int, metric: ColorMetric):
+    """Recolor stage: (key, recolored frame or None, its colors, duration), in frame order for
+    the color table. A frame seen before stays None, a color already in the table always
+    maps the same so the first output of it is reused."""
+    reused = 0
+    with ColorTable(replace_colors, metric) as table:
+        for key, frame, original_size, frame_duration in items:
+            if frame is None:
+                reused += 1
+                yield key, None, None, frame_duration
+                continue
+            frame, colors = _replace_frame(frame, table, lc, max_dist, mode)
+            with span('convert'):
+                frame = frame.resize(original_size)
+            yield key, frame, colors, frame_duration
+    add_counters({'dedup_reused': reused})
+
+
+@in_executor(process=True)
+def replace_gif_colors(
+    image: Image.Image,
+    replace_colors: list,
+    max_dist: float = 12.0,
+    mode: int = 2,
+    *,
+    newsize: int = 512,
+    max_frames: int = 200,
+    fmt: AnimationFormat = 'gif',
+    metric: ColorMetric = 'cie2000'
+):
+    max_dist = float(max_dist)
+    _check_colors(replace_colors)
+    lc = len(replace_colors)//3
 
-@in_executor()
+    # decode and recolor run on threads of their own, the frames are encoded here as they come
+    frames = pipeline(
+        _decode_frames(image, newsize, max_frames),
+        lambda items: _recolor_frames(items, replace_colors, lc, max_dist, mode, metric),
+    )
+    if fmt == 'gif':
+        keys = []
+        duration = []
+        palette = GlobalPalette()
+        for key, frame, colors, frame_duration in frames:
+            keys.append(key)
+            duration.append(frame_duration)
+            if frame is not None:
+                with span('convert'):
+                    palette.add(key, frame, colors)
+                frame.close()
+        add_info(frames=len(keys))
+        with span('convert'):
+            # every frame shares the assigned colors, one palette instead of one per frame
+            images, palette, transparency = palette.images(keys)
+        with span('encode'):
+            return frames_to_image(images, duration, fmt, palette=palette, transparency=transparency)
+
+    # apng keeps truecolor frames, and encodes each one as soon as it's recolored
+    def images():
+        done = {}
+        for key, frame, _, frame_duration in frames:
+            if frame is None:
+                frame = done[key].copy()
+            else:
+                done[key] = frame
+            frame.info['duration'] = frame_duration
+            yield frame
+
+    with span('encode'):
+        return frames_to_image(images(), fmt=fmt)
+
+
+@in_executor(process=True)
 def replace_single_colors(
     im: Image.Image,
     replace_colors: list,
     max_dist: float = 12.0,
     mode: typing.Literal[0, 1, 2, 3] = 2,
     *,
-    newsize: int=1024
+    newsize: int=1024,
+    metric: ColorMetric = 'cie2000'
 ):
     max_dist = float(max_dist)
-    if not replace_colors or len(replace_colors) % 3 != 0 or any(not 0<=x<=255 for x in replace_colors):
-
-        raise ValueError(f'replace_colors should be tuple/list of int, values between 0-255\n{type(replace_colors)}, {type(replace_colors[0])}\n{replace_colors}')
+    _check_colors(replace_colors)
     lc = min(len(replace_colors)//3 + 1, 256)
 
-    other_colorsp = ffi.new("ToReplace*")
-    cp = ffi.new("int *", 0)
-    other_colorsp.current = cp
-    other_colorsp.size = len(replace_colors)
-
-    colorsp = ffi.new('char []', [_.to_bytes(1, sys.byteorder) for _ in replace_colors])
-    other_colorsp.colors = colorsp
-
-    other_colors = other_colorsp[0]
-
-    ccolors = lib.create_ptr(SIZE, 1)
-
-    colors_ptrp = ffi.new('ReplacedColors*')
-    colors_ptrp.colors = ccolors
-    colors_ptrp.current = 0
-    colors_ptrp.size = 1
-
-    colors_ptr = colors_ptrp[0]
-
-    palette_len = 768
-    max_dist = max_dist
-
-    raw_ret = (b'\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00'*64)
-    ret = ffi.new('char []', raw_ret)
-
-    original_size = im.size
-    im = im.resize((im.width * 2, im.height * 2))
-    original_alpha = im.convert('RGBA').getchannel('A')
-    try:
-        im = im.convert('RGB')
-        im = im.quantize(lc, method=mode, dither=Image.NONE)
-    except Exception:
-        mode = 2
-        im = im.quantize(lc, method=mode, dither=Image.NONE)
-    palette, mapping = sort_palette(im)
-
-    input_colors = ffi.new('double []', [float(x) for x in palette])
-
-    colors_ptr = lib.replace_colors(input_colors, palette_len, max_dist, ret, colors_ptr, other_colors)
-
-    palette = [int.from_bytes(x, sys.byteorder) for x in ret]
-    new_palette = [0] * 768
-    for i, index in enumerate(mapping):
-        new_palette[index*3:index*3+3] = palette[i*3:i*3+3]
-
-    im.putpalette(new_palette)
-    im.info.pop('transparency', None)
-    im = im.convert('RGBA')
-    im.putalpha(original_alpha)
-    if newsize:
-        im = _limit_size(im.resize(original_size), max_size=newsize)
-    lib.free_ptr(colors_ptr.colors)
-
-    return frames_to_image(im)
-
+    with ColorTable(replace_colors, metric) as table:
+        # work at 2x of the capped output size, never at 2x of a huge input
+        original_size = fit_size(im.size, max_size=newsize)
+        with span('decode'):
+            im = decode_reduced(im, (original_size[0] * 2, original_size[1] * 2))
+        im, _ = _replace_frame(im, table, lc, max_dist, mode)
+        with span('convert'):
+            im = im.resize(original_size)
+
+    with span('encode'):
+        return frames_to_image(im)
+
+
+def _color_counts(data: bytes, max_frames: int) -> dict[int, int]:
+    """How many opaque pixels of every frame of ``data`` show each 24 bit RGB color."""
+    counts: dict[int, int] = {}
+    with Image.open(io.BytesIO(data)) as image:
+        for im, _ in iter_frames(image, max_frames=max_frames):
+            arr = np.asarray(im.convert('RGBA'))
+            arr = arr[arr[..., 3] > 0].astype(np.uint32)
+            packed, n = np.unique((arr[:, 0] << 16) | (arr[:, 1] << 8) | arr[:, 2], return_counts=True)
+            for color, count in zip(packed.tolist(), n.tolist()):
+                counts[color] = counts.get(color, 0) + count
+    return counts
+
+
+def _palette_clusters(palette: np.ndarray, weights: np.ndarray, lc: int) -> tuple[np.ndarray, np.ndarray]:
+    """Group ``palette`` into ``lc`` colors with the quantizer of the pixel path, each entry
+    weighted by how often it's seen. The colors sorted by use as ``sort_palette`` does, and
+    the index of the color of every entry."""
+    # a pixel per 1/65536 of the weight, an unused entry still needs one to get a color
+    total = max(int(weights.sum()), 1)
+    repeat = np.maximum(weights * 65536 // total, 1).astype(np.intp)
+    pixels = np.repeat(palette, repeat, axis=0).reshape(1, -1, 3)
+    im = Image.fromarray(pixels, 'RGB').quantize(lc, method=2, dither=Image.NONE)
+    colors, mapping = sort_palette(im)
+    order = np.zeros(256, dtype=np.intp)
+    order[mapping] = np.arange(len(mapping))
+    first = np.cumsum(repeat) - repeat
+    return colors[:len(mapping)], order[np.asarray(im)[0, first]]
+
+
+@in_executor(process=True)
+def replace_indexed_colors(
+    data: bytes,
+    replace_colors: list,
+    max_dist: float = 12.0,
+    *,
+    mime: str,
+    lc: int,
+    newsize: int,
+    max_frames: int,
+    metric: ColorMetric = 'cie2000'
+) -> typing.Optional[io.BytesIO]:
+    """Recolor an indexed ``mime`` image in the palette domain. Only its color tables are
+    replaced, the index data and every other block are copied as they are, so it's the same
+    size and timing as the input. The entries of a table are quantized to ``lc`` colors by
+    how often they're seen, as the pixel path quantizes a frame, and each color is replaced.
+    None when the input isn't indexed, or the pixel path would have resized it or dropped
+    frames."""
+    info = probe_header(data)
+    if info is None or info.mime != mime or max(info.width, info.height) > newsize:
+        return None
+    if count_frames(data, info) > max_frames:
+        return None
+    tables = palette_tables(data)
+    if not tables:
+        return None
 
-@in_executor()
+    max_dist = float(max_dist)
+    _check_colors(replace_colors)
+    with span('decode'):
+        counts = _color_counts(data, max_frames)
+    out = bytearray(data)
+    with ColorTable(replace_colors, metric) as table:
+        for t in tables:
+            end = t.offset + 3 * t.colors
+            palette = np.frombuffer(data, dtype=np.uint8, count=end - t.offset, offset=t.offset).reshape(-1, 3).copy()
+            # transparent entries are never seen, don't spend replacement colors on them
+            keep = np.array([i for i in range(t.colors) if i not in t.transparent], dtype=np.intp)
+            if len(keep):
+                rgb = palette[keep].astype(np.uint32)
+                packed = (rgb[:, 0] << 16) | (rgb[:, 1] << 8) | rgb[:, 2]
+                weights = np.array([counts.get(color, 0) for color in packed.tolist()], dtype=np.int64)
+                with span('quantize'):
+                    colors, cluster = _palette_clusters(palette[keep], weights, lc)
+                palette[keep] = table.replace(colors, max_dist)[cluster]
+            out[t.offset:end] = palette.tobytes()
+            if t.chunk is not None:
+                out[end:end+4] = zlib.crc32(out[t.chunk:end]).to_bytes(4, 'big')
+    add_info(palettes=len(tables), frames=count_frames(data, info))
+    return io.BytesIO(bytes(out))
+
+
+@in_executor(process=True)
 def extract_colors(image, num_colors):
-    image = image.quantize(num_colors, dither=Image.NONE)
-    colors, _ = sort_palette(image)
-    i = iter(colors)
-    ret_colors = []
-    while True:
-        try:
-            rgb = next(i), next(i), next(i)
-            if any(rgb):
-                ret_colors.extend(rgb)
-        except StopIteration:
-            return ret_colors
+    with span('extract'):
+        image = image.quantize(num_colors, dither=Image.NONE)
+        colors, _ = sort_palette(image)
+    return [c for rgb in colors.tolist() if any(rgb) for c in rgb]
 
 
-def frames_to_image(frames, durations=None):
+def frames_to_image(
+    frames,
+    durations=None,
+    fmt: AnimationFormat = 'gif',
+    *,
+    palette: typing.Optional[bytes] = None,
+    transparency: typing.Optional[int] = None
+):
+    """Encode one image, or a list of frames as an animation. An iterator of frames is
+    encoded as it makes them, each with the duration in its info. A gif with ``palette`` is
+    written with it as the global color table and no local ones."""
     ret = io.BytesIO()
     if isinstance(frames, Image.Image):
         frames.save(ret, format='fpng', optimize=True)
         frames.close()
-    elif isinstance(frames, list):
-        frames[0].save(
+    else:
+        extra = {}
+        if palette is not None:
+            extra['palette'] = palette
+        if transparency is not None:
+            extra['transparency'] = transparency
+        if isinstance(frames, list):
+            first, rest = frames[0], frames[1:]
+        else:
+            rest = iter(frames)
+            first = next(rest)
+        first.save(
             ret,
-            format='gif',
+            format=fmt,
             save_all=True,
-            append_images=frames[1:],
-            dispose=2,
+            append_images=rest,
+            # frames with transparency would pile up without it
+            disposal=2,
             loop=0,
             duration=durations,
-            optimize=True
+            optimize=True,
+            **extra
         )
-        for frame in frames:
-            frame.close()
+        if isinstance(frames, list):
+            for frame in {id(frame): frame for frame in frames}.values():
+                frame.close()
 
     ret.seek(0)
     return ret
 
 
-def sort_palette(im):
-    ret = [0, 0, 0] * 256
-    mapping = []
-    palette = im.getpalette()
+def sort_palette(im) -> tuple[np.ndarray, np.ndarray]:
+    """Palette of ``im`` as a (256, 3) array sorted by how often each color is used,
+    and the original palette index of each sorted color."""
+    ret = np.zeros([256, 3], dtype=np.uint8)
+    palette = np.array(im.getpalette(), dtype=np.uint8).reshape(-1, 3)
     top_colors = sorted(im.getcolors(), reverse=True)
-    for i in range(len(top_colors)):
-        color_index = top_colors[i][1]
-        mapping.append(color_index)
-        color = palette[color_index * 3:(color_index + 1) * 3]
-        ret[i*3:(i+1)*3] = color
+    mapping = np.array([index for _, index in top_colors], dtype=np.intp)
+    ret[:len(mapping)] = palette[mapping]
     return ret, mapping
@@ -0,0 +1,36 @@
+#ifndef HEADER_ISA
+#define HEADER_ISA
+
+/*
+ * Function multiversioning for the hot loops. Every ISA_CLONES function is compiled once per
+ * target and the loader picks one through cpuid when the extension is loaded (an ifunc), so one
+ * build runs everywhere. The extensions are built with -ffp-contract=off: no clone may fuse a
+ * multiply-add the default one doesn't, every clone gives the same bits.
+ * Build with -DNO_ISA_CLONES to get only the default version.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(NO_ISA_CLONES)
+# define ISA_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+# define HAVE_ISA_CLONES 1
+#else
+# define ISA_CLONES
+# define HAVE_ISA_CLONES 0
+#endif
+
+// the clone the loader picks, same priority order as the resolver
+static inline const char *isa_name(void){
+#if HAVE_ISA_CLONES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        return "avx512f";
+    }
+    if (__builtin_cpu_supports("avx2")){
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.2")){
+        return "sse4.2";
+    }
+#endif
+    return "default";
+}
+
+#endif
@@ -1,21 +1,32 @@
 import io
 import re
 import math
+import functools
 
 from collections.abc import Generator
 from typing import Any, Optional, Literal, Callable, Union
 
 from PIL import Image, ImageFont, ImageDraw
 
-from ...utils.function_utils import in_executor
+from ...utils.function_utils import in_executor, AnimationFormat
+from ...utils.metrics import span, add_info
 
-__all__ = ('runescape',)
+__all__ = ('runescape', 'warm')
 
 
-@in_executor()
-def runescape(text: str) -> tuple[Optional[io.BytesIO], Optional[Literal['png', 'gif']]]:
+@functools.lru_cache(maxsize=None)
+def _font() -> ImageFont.FreeTypeFont:
+    return ImageFont.truetype('routes/src/runescape/rs.ttf', size=24)
+
+
+def warm():
+    _font()
+
+
+@in_executor(process=True)
+def runescape(text: str, fmt: AnimationFormat = 'gif') -> tuple[Optional[io.BytesIO], Optional[Literal['png', 'gif', 'apng']]]:
     text = text.replace('\n', ' ')
-    f, format = draw_rs_text(text)
+    f, format = draw_rs_text(text, fmt)
     return f, format
 
 
@@ -140,7 +151,7 @@ def rs_get_color(color, index, num_frames):
         return rs_glow_color(int(color[-1]), index=index, num_frames=num_frames)
 
 
-def draw_rs_text(full_text: str) -> tuple[Optional[io.BytesIO], Optional[Literal['png', 'gif']]]:
+def draw_rs_text(full_text: str, fmt: AnimationFormat = 'gif') -> tuple[Optional[io.BytesIO], Optional[Literal['png', 'gif', 'apng']]]:
     re_colors = '|'.join([*RS_STATIC_COLORS, *RS_ANIMATED_COLORS])
     re_effects = '|'.join(RS_MOVEMENT_LOOKUP)
     pattern = rf'(?:(?P<color>{re_colors}):\s*)?(?:(?P<effect>{re_effects}):)?\s*(?P<text>.+)'
@@ -166,7 +177,7 @@ def draw_rs_text(full_text: str) -> tuple[Optional[io.BytesIO], Optional[Literal
     animated = method or _color in RS_ANIMATED_COLORS
     num_frames = 90 if method in (rs_scroll_position, rs_slide_position) else 30
 
-    font = ImageFont.truetype('routes/src/runescape/rs.ttf', size=24)
+    font = _font()
 
     clamp_y = True if method in (rs_slide_position, rs_scroll_position) or not animated else False
     clamp_x = method == rs_scroll_position
@@ -199,60 +210,66 @@ def draw_rs_text(full_text: str) -> tuple[Optional[io.BytesIO], Optional[Literal
         text_len = len(text)
         frames = []
         num_steps = 30 if method == rs_wave2_position else 15
-        for i in range(num_frames):
-            frame = image.copy()
-            draw = ImageDraw.Draw(frame)
-            color = rs_get_color(_color, i, num_frames)
-            if method in shake_wave:
-                for char, (x_offset, y_offset) in zip(text, method(text_len, index=i, height=height, num_steps=num_steps)):  # type: ignore  # should only return generator of tuple[float, float]
+        with span('render'):
+            for i in range(num_frames):
+                frame = image.copy()
+                draw = ImageDraw.Draw(frame)
+                color = rs_get_color(_color, i, num_frames)
+                if method in shake_wave:
+                    for char, (x_offset, y_offset) in zip(text, method(text_len, index=i, height=height, num_steps=num_steps)):  # type: ignore  # should only return generator of tuple[float, float]
+                        draw.text(
+                            (posx + x_offset, posy + y_offset),
+                            char,
+                            font=font,
+                            fill=color
+                        )
+                        _, _, posx, _ = draw.textbbox((posx, posy), char, font=font)
+                    posx = startx
+                elif method in slide_scroll:
+                    x_offset, y_offset = method(
+                        index=i,
+                        text_x_size=text_x_size,
+                        text_y_size=text_y_size,
+                        im_width=im_width,
+                        im_height=im_height,
+                        x_offset=startx,
+                        y_offset=starty,
+                        frames=num_frames,
+                    )
                     draw.text(
-                        (posx + x_offset, posy + y_offset),
-                        char,
+                        (posx + x_offset, posy + y_offset),  # type: ignore  # offsets should be floats
+                        text,
                         font=font,
-                        fill=color
+                        fill=color,
                     )
-                    _, _, posx, _ = draw.textbbox((posx, posy), char, font=font)
-                posx = startx
-            elif method in slide_scroll:
-                x_offset, y_offset = method(
-                    index=i,
-                    text_x_size=text_x_size,
-                    text_y_size=text_y_size,
-                    im_width=im_width,
-                    im_height=im_height,
-                    x_offset=startx,
-                    y_offset=starty,
-                    frames=num_frames,
-                )
-                draw.text(
-                    (posx + x_offset, posy + y_offset),  # type: ignore  # offsets should be floats
-                    text,
-                    font=font,
-                    fill=color,
-                )
-            else:
-                draw.text(
-                    (posx, posy),
-                    text,
-                    font=font,
-                    fill=color,
-                )
-            frames.append(frame.quantize(256))
-
-        frames[0].save(final, format='gif', save_all=True, append_images=frames[1:], loop=0, duration=duration, optimize=True)
+                else:
+                    draw.text(
+                        (posx, posy),
+                        text,
+                        font=font,
+                        fill=color,
+                    )
+                # apng keeps truecolor frames
+                frames.append(frame.quantize(256) if fmt == 'gif' else frame)
+
+        with span('encode'):
+            frames[0].save(final, format=fmt, save_all=True, append_images=frames[1:], loop=0, duration=duration, optimize=True)
     else:
         color = RS_STATIC_COLORS.get(_color)
-        draw = ImageDraw.Draw(image)
-        draw.text(
-            (posx, posy),
-            text,
-            font=font,
-            fill=color,
-        )
-        image.save(final, format='fpng', optimize=True)
-
+        with span('render'):
+            draw = ImageDraw.Draw(image)
+            draw.text(
+                (posx, posy),
+                text,
+                font=font,
+                fill=color,
+            )
+        with span('encode'):
+            image.save(final, format='fpng', optimize=True)
+
+    add_info(size=list(image.size), frames=num_frames if animated else 1)
     final.seek(0)
-    return final, 'gif' if animated else 'png'
+    return final, fmt if animated else 'png'
 
 
 RS_STATIC_COLORS: dict[str, tuple[int, int, int]] = {
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 
@@ -7,47 +8,44 @@
 #include "debris.h"
 #include "dust.h"
 
-void c_particles(unsigned char* reference,
-                 unsigned int shape[],
-                 unsigned int stride[],
-                 unsigned char* ret,
-                 unsigned int frames,
-                 unsigned int new_particle_count,
-                 unsigned int skip,
-                 unsigned int type){
-
-    unsigned int MAX_INDEX = shape[0] * shape[1] * shape[2];
+// the kernels of a grain material, `type` is a constant wherever these are inlined
+KERNEL void update_grain(unsigned int type, Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
+    if (type == GRAIN_WATER || type == GRAIN_PISS) {
+        update_liquid(particles, particle_number, arr, shape, stride);
+    } else {
+        update_sand(particles, particle_number, arr, shape, stride);
+    }
+}
 
-    Particle* particles = malloc(sizeof(Particle) * frames * new_particle_count * skip * 2);
+KERNEL void draw_grain(unsigned int type, Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
+    if (type == GRAIN_WATER) {
+        draw_liquid(particles, particle_number, arr, offset, stride, fill);
+    } else if (type == GRAIN_PISS) {
+        draw_piss(particles, particle_number, arr, offset, stride, fill);
+    } else {
+        draw_sand(particles, particle_number, arr, offset, stride, fill);
+    }
+}
 
+// frame/substep driver of the grain materials, one copy per GRAIN_MATERIALS entry
+KERNEL void grain_frames(unsigned int type,
+                         Particle* particles,
+                         unsigned int *start_cols,
+                         unsigned char* reference,
+                         unsigned int shape[],
+                         unsigned int stride[],
+                         unsigned char* ret,
+                         unsigned int frame_stride,
+                         unsigned int frames,
+                         unsigned int new_particle_count,
+                         unsigned int skip,
+                         double clock) {
     unsigned int current_offset, particle_counter;
     unsigned int total_particles = 0, skip_counter = 0;
 
-    unsigned int *start_cols = malloc(sizeof(int) * new_particle_count);
-
-    void (*update_particle)(Particle*, unsigned int, unsigned char*, unsigned int[], unsigned int[]);
-    void (*draw_particle)(Particle*, unsigned int, unsigned char*, unsigned int, unsigned int[], unsigned char);
-
-    switch(type){
-        case 0:
-        case 1:
-            update_particle = &update_sand;
-            draw_particle = &draw_sand;
-            break;
-        case 2:
-            update_particle = &update_liquid;
-            draw_particle = &draw_liquid;
-            break;
-        case 3:
-            update_particle = &update_liquid;
-            draw_particle = &draw_piss;
-            break;
-    }
-
-
     for (unsigned int frame=1; frame < frames; frame++) {
         // create each frame
-        current_offset = MAX_INDEX * frame;
+        current_offset = frame_stride * frame;
 
         // update by number of skips before drawing the final frame
         for (skip_counter=0; skip_counter < skip * 2; skip_counter++) {
@@ -63,244 +61,361 @@ void c_particles(unsigned char* reference,
                     particles[total_particles].col = start_cols[particle_counter] + 35;
                     particles[total_particles].color = get_color(type);
                     total_particles++;
+                    STAT_ADD(particles_created, 1);
                 }
             }
+            STAT_PHASE(spawn_seconds, clock);
 
             // update each particle and reference image
             for (particle_counter=0; particle_counter < total_particles; particle_counter++) {
-                (*update_particle)(particles, particle_counter, reference, shape, stride);
+                update_grain(type, particles, particle_counter, reference, shape, stride);
             }
+            STAT_PHASE(simulate_seconds, clock);
         }
 
         // draw on the return array
         for (particle_counter=0; particle_counter < total_particles; particle_counter++) {
-            draw_particle(particles, particle_counter, ret, current_offset, stride, (unsigned char)255);
+            draw_grain(type, particles, particle_counter, ret, current_offset, stride, (unsigned char)255);
         }
+        STAT_PHASE(draw_seconds, clock);
     }
-    free(particles);
-    free(start_cols);
 }
 
+// a new grain material is its kernels in update_grain/draw_grain and an entry here
+# define GRAIN_MATERIALS(X) X(GRAIN_SALT) X(GRAIN_PEPPER) X(GRAIN_WATER) X(GRAIN_PISS)
 
-void c_debris(int *active,
-              unsigned char *reference,
-              unsigned char *active_ref,
-              unsigned int shape[],
-              unsigned int stride[],
-              unsigned char* ret,
-              unsigned int frames,
-              unsigned int percent){
+/*
+ * ret holds `frames` frames of `frame_stride` bytes, every frame starts as a copy of reference.
+ * reference is used as the simulation buffer and is modified.
+ */
+void c_particles(unsigned char* reference,
+                 unsigned int shape[],
+                 unsigned int stride[],
+                 unsigned char* ret,
+                 unsigned int frame_stride,
+                 unsigned int frames,
+                 unsigned int new_particle_count,
+                 unsigned int skip,
+                 unsigned int type,
+                 SaltStats *stats){
 
-    unsigned int MAX_INDEX = shape[0] * shape[1] * shape[2];
+    size_t frame_size = (size_t)shape[0] * stride[0];
+    double clock;
 
-    Debris* debris_arr = malloc(sizeof(Debris) * shape[0] * shape[1]);
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
 
-    unsigned int current_offset, debris_counter;
-    unsigned int total_debris = 0, i;
-    unsigned char A;
+    size_t particles_size = sizeof(Particle) * frames * new_particle_count * skip * 2;
+    unsigned char *scratch = scratch_get(particles_size + sizeof(int) * new_particle_count);
+    if (scratch == NULL) {
+        salt_stats = NULL;
+        return;
+    }
+    Particle* particles = (Particle *)scratch;
+    unsigned int *start_cols = (unsigned int *)(scratch + particles_size);
 
-    // create debris
-    for (unsigned int row=0; row < shape[0]; row++) {
-        for (unsigned int col=0; col < shape[1]; col++){
-            i = (row * stride[0]) + (col * stride[1]);
-            A = reference[i+3];
-            if (A > ALPHA_THRESHOLD) {
-                // check if we should add
-                if ((unsigned int)(rand() % 100) < percent) {
-                    debris_arr[total_debris].R = reference[i];
-                    debris_arr[total_debris].G = reference[i+1];
-                    debris_arr[total_debris].B = reference[i+2];
-                    debris_arr[total_debris].A = A;
-                    debris_arr[total_debris].active = 1;
-                    debris_arr[total_debris].row = (double)row;
-                    debris_arr[total_debris].col = (double)col;
-                    debris_arr[total_debris].row_velocity = (double)-((rand() % 15000)/1000 + 10);
-                    debris_arr[total_debris].col_velocity = (double)(rand() % 40000)/1000 - 20;
-                    total_debris++;
-                } else {
-                    // turn to transparent/remove
-                    reference[i+3] = 0;
-                }
-            } else {
-                reference[i+3] = 0;
-            }
-        }
+    // background for every frame, libc's memcpy already picks its version per CPU
+    for (unsigned int frame=0; frame < frames; frame++) {
+        memcpy(ret + (size_t)frame * frame_stride, reference, frame_size);
     }
+    STAT_PHASE(draw_seconds, clock);
+
+    switch(type){
+# define GRAIN_CASE(material) \
+        case material: \
+            grain_frames(material, particles, start_cols, reference, shape, stride, ret, frame_stride, \
+                         frames, new_particle_count, skip, clock); \
+            break;
+        GRAIN_MATERIALS(GRAIN_CASE)
+# undef GRAIN_CASE
+    }
+    salt_stats = NULL;
+}
+
+
+// debris of the pixel at index i of reference
+KERNEL void add_debris(Debris* debris_arr, unsigned int *total_debris, const unsigned char *reference, unsigned int i,
+                       unsigned int row, unsigned int col, char active, double row_velocity, double col_velocity) {
+    Debris *debris = &debris_arr[(*total_debris)++];
+    debris->R = reference[i];
+    debris->G = reference[i+1];
+    debris->B = reference[i+2];
+    debris->A = reference[i+3];
+    debris->active = active;
+    debris->row = (double)row;
+    debris->col = (double)col;
+    debris->row_velocity = row_velocity;
+    debris->col_velocity = col_velocity;
+    STAT_ADD(particles_created, 1);
+}
+
+/*
+ * frame driver of debris, flying is a constant wherever it's inlined. Settled debris moves like
+ * sand, two steps a frame, flying debris (active) one step of its velocity. Without flying every
+ * debris is settled from the start and stays that way.
+ */
+KERNEL void debris_frames(int flying,
+                          Debris* debris_arr,
+                          unsigned int total_debris,
+                          int *active,
+                          unsigned char *active_ref,
+                          unsigned int shape[],
+                          unsigned int stride[],
+                          unsigned char* ret,
+                          unsigned int frame_stride,
+                          unsigned int frames,
+                          double clock) {
+    unsigned int current_offset, debris_counter;
 
     // draw initial frame
     for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
         draw_debris(debris_arr, debris_counter, ret, 0, stride, 255);
     }
+    STAT_PHASE(draw_seconds, clock);
 
     for (unsigned int fc=1; fc < frames; fc++) {
-        //printf("%u\n", fc);
-        current_offset = fc * MAX_INDEX;
-        //update inactive debris
+        current_offset = fc * frame_stride;
+        // update settled debris
         for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
-            if (debris_arr[debris_counter].active == 0){
+            if (!flying || debris_arr[debris_counter].active == 0){
                 update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
                 update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
             }
         }
-        // update all active debris
-        for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
-            if (debris_arr[debris_counter].active != 0){
-                update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
+        // update all flying debris
+        if (flying) {
+            for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
+                if (debris_arr[debris_counter].active != 0){
+                    update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
+                }
             }
         }
+        STAT_PHASE(simulate_seconds, clock);
         // draw all debris
         for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
             draw_debris(debris_arr, debris_counter, ret, current_offset, stride, 255);
         }
+        STAT_PHASE(draw_seconds, clock);
+    }
+}
+
+void c_debris(int *active,
+              const unsigned char *reference,
+              unsigned char *active_ref,
+              unsigned int shape[],
+              unsigned int stride[],
+              unsigned char* ret,
+              unsigned int frame_stride,
+              unsigned int frames,
+              unsigned int percent,
+              SaltStats *stats){
+
+    Debris* debris_arr = scratch_get((sizeof(Debris) + sizeof(unsigned int)) * shape[0] * shape[1]);
+    if (debris_arr == NULL) {
+        return;
+    }
+    unsigned int *cols = (unsigned int *)(debris_arr + shape[0] * shape[1]);
+
+    unsigned int total_debris = 0, count, col, pixel;
+    uint64_t seed = random_seed(), draw;
+    double clock, row_velocity, col_velocity;
+
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
+
+    // create debris, every opaque pixel has its own draw: 16 bits for percent, 24 for each velocity
+    for (unsigned int row=0; row < shape[0]; row++) {
+        count = opaque_cols(reference + row * stride[0], shape[1], stride[1], cols);
+        for (unsigned int k=0; k < count; k++) {
+            col = cols[k];
+            pixel = row * shape[1] + col;
+            draw = random_at(seed, pixel);
+            if (RANDOM_RANGE(draw >> 48, 16, 100) < percent) {
+                row_velocity = (double)-((int)RANDOM_RANGE(draw >> 24, 24, 15000)/1000 + 10);
+                col_velocity = (double)RANDOM_RANGE(draw, 24, 40000)/1000 - 20;
+                add_debris(debris_arr, &total_debris, reference, row * stride[0] + col * stride[1], row, col, 1, row_velocity, col_velocity);
+            }
+        }
     }
+    STAT_PHASE(spawn_seconds, clock);
 
-    free(debris_arr);
+    debris_frames(1, debris_arr, total_debris, active, active_ref, shape, stride, ret, frame_stride, frames, clock);
+    salt_stats = NULL;
 }
 
-void c_dust(unsigned char* reference,
+void c_dust(const unsigned char* reference,
             unsigned int shape[],
             unsigned int stride[],
             unsigned int max_dust,
             unsigned int frames,
-            unsigned char* ret) {
+            unsigned char* ret,
+            unsigned int frame_stride,
+            SaltStats *stats) {
     unsigned int max_col = (shape[1] * 1.2), min_col = max_col - shape[1]/3;
 
-    unsigned int dust_counter, total_dust=0, i, current_offset;
-    Dust * dusts = malloc(sizeof(Dust) * max_dust);
+    unsigned int total_dust=0, i, current_offset, count;
+    Dust * dusts = scratch_get(sizeof(Dust) * max_dust + sizeof(unsigned int) * shape[1]);
+    if (dusts == NULL) {
+        return;
+    }
+    unsigned int *cols = (unsigned int *)(dusts + max_dust);
+    double clock;
 
-    unsigned int MAX_INDEX = shape[0] * shape[1] * shape[2];
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
 
     // create dust
     for (unsigned int row=0; row < shape[0]; row++) {
-        for (unsigned int col=0; col<shape[1]; col++) {
-            i = (row * stride[0]) + (col * stride[1]);
-            unsigned char A = reference[i+3];
-            if (A > ALPHA_THRESHOLD) {
-                dusts[total_dust].R = reference[i];
-                dusts[total_dust].G = reference[i+1];
-                dusts[total_dust].B = reference[i+2];
-                dusts[total_dust].A = A;
-                dusts[total_dust].x_velocity = 0;
-                dusts[total_dust].active = 0;
-                dusts[total_dust].row = (double)row;
-                dusts[total_dust].col = (double)col;
-                total_dust++;
-            } else {
-                reference[i+3] = 0;
-            }
+        count = opaque_cols(reference + row * stride[0], shape[1], stride[1], cols);
+        for (unsigned int k=0; k < count; k++) {
+            i = (row * stride[0]) + (cols[k] * stride[1]);
+            dusts[total_dust].R = reference[i];
+            dusts[total_dust].G = reference[i+1];
+            dusts[total_dust].B = reference[i+2];
+            dusts[total_dust].A = reference[i+3];
+            dusts[total_dust].x_velocity = 0;
+            dusts[total_dust].active = 0;
+            dusts[total_dust].row = (double)row;
+            dusts[total_dust].col = (double)cols[k];
+            total_dust++;
         }
+        STAT_ADD(particles_created, count);
     }
+    STAT_PHASE(spawn_seconds, clock);
     // draw initial frame
-    for (dust_counter=0; dust_counter < total_dust; dust_counter++) {
-        draw_dust(dusts, dust_counter, ret, 0, shape, stride);
-    }
+    draw_dusts(dusts, total_dust, ret, 0, shape, stride);
+    STAT_PHASE(draw_seconds, clock);
     // draw rest of the frames
     for (unsigned int fc=1; fc < frames; fc++) {
-        current_offset = fc * MAX_INDEX;
-        for (dust_counter=0; dust_counter < total_dust; dust_counter++) {
-            update_dust(dusts, dust_counter, max_col, min_col, shape);
-        }
-        // draw all debris
-        for (dust_counter=0; dust_counter < total_dust; dust_counter++) {
-            draw_dust(dusts, dust_counter, ret, current_offset, shape, stride);
-        }
+        current_offset = fc * frame_stride;
+        update_dusts(dusts, total_dust, max_col, min_col, shape);
+        STAT_PHASE(simulate_seconds, clock);
+        // draw all dust
+        draw_dusts(dusts, total_dust, ret, current_offset, shape, stride);
+        STAT_PHASE(draw_seconds, clock);
         max_col -= 2;
         min_col -= 2;
     }
-    free(dusts);
+    salt_stats = NULL;
+}
+
+
+// the dust of c_dust as DustPaths, returns how many. Its paths are drawn from one rand() seed
+unsigned int c_dust_paths(const unsigned char* reference,
+                          unsigned int shape[],
+                          unsigned int stride[],
+                          unsigned int frames,
+                          DustPath* paths,
+                          SaltStats *stats) {
+    int max_col = (shape[1] * 1.2), range = shape[1]/3;
+    uint64_t seed = random_seed(), draw;
+    unsigned int total_dust = 0, i, count;
+    unsigned int *cols = scratch_get(sizeof(unsigned int) * shape[1]);
+    if (cols == NULL) {
+        return 0;
+    }
+    double clock;
+
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
+
+    for (unsigned int row=0; row < shape[0]; row++) {
+        count = opaque_cols(reference + row * stride[0], shape[1], stride[1], cols);
+        for (unsigned int k=0; k < count; k++) {
+            DustPath *path = paths + total_dust;
+            i = (row * stride[0]) + (cols[k] * stride[1]);
+            path->R = reference[i];
+            path->G = reference[i+1];
+            path->B = reference[i+2];
+            path->A = reference[i+3];
+            path->row = row;
+            path->col = cols[k];
+            // the walk and the start get a key each
+            path->key = random_at(seed, 2 * (uint64_t)total_dust);
+            draw = random_at(seed, 2 * (uint64_t)total_dust + 1);
+            path->velocity = (double)RANDOM_RANGE(draw, 16, 200)/400 + 1;
+            path->speedup = (unsigned int)ceil((DUST_TOP_SPEED - path->velocity) / DUST_ACCELERATION);
+            path->start = dust_start(cols[k], max_col, range, draw, frames);
+            total_dust++;
+        }
+        STAT_ADD(particles_created, count);
+    }
+    STAT_PHASE(spawn_seconds, clock);
+    salt_stats = NULL;
+    return total_dust;
+}
+
+
+/*
+ * Frames [first, last) of a closed form dust of `frames` frames into ret, frame `first` at the
+ * start of it. Every frame is drawn from the paths alone, calls for different frames can run
+ * at the same time.
+ */
+void c_dust_frames(const DustPath* paths,
+                   unsigned int total_dust,
+                   unsigned int shape[],
+                   unsigned int stride[],
+                   unsigned int frames,
+                   unsigned int first,
+                   unsigned int last,
+                   unsigned char* ret,
+                   unsigned int frame_stride,
+                   SaltStats *stats) {
+    // update_dust's row jitter is uniform over [-offset, offset]
+    unsigned int offset = shape[0]/40, span = 1;
+    double sigma = sqrt(offset * (offset + 1) / 3.0), clock;
+
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
+
+    // the walk has to cover every frame the same way in every call
+    while (span < frames) {
+        span *= 2;
+    }
+    for (unsigned int fc=first; fc < last; fc++) {
+        unsigned char *frame = ret + (size_t)(fc - first) * frame_stride;
+        memset(frame, 0, (size_t)shape[0] * stride[0]);
+        draw_dust_paths(paths, total_dust, fc, span, sigma, frame, shape, stride);
+        STAT_ADD(update_calls, total_dust);
+    }
+    STAT_PHASE(draw_seconds, clock);
+    salt_stats = NULL;
 }
 
 
 void c_crumble(int* active,
                unsigned char *active_ref,
-               unsigned char *reference,
+               const unsigned char *reference,
                unsigned int shape[],
                unsigned int stride[],
                unsigned char* ret,
-               unsigned int frames){
+               unsigned int frame_stride,
+               unsigned int frames,
+               SaltStats *stats){
 
-    unsigned int MAX_INDEX = shape[0] * shape[1] * shape[2];
+    Debris* debris_arr = scratch_get((sizeof(Debris) + sizeof(unsigned int)) * shape[0] * shape[1]);
+    if (debris_arr == NULL) {
+        return;
+    }
+    unsigned int *cols = (unsigned int *)(debris_arr + shape[0] * shape[1]);
 
-    Debris* debris_arr = malloc(sizeof(Debris) * shape[0] * shape[1]);
+    unsigned int total_debris = 0, count, col;
+    double clock;
 
-    unsigned int current_offset, debris_counter;
-    unsigned int total_debris = 0, i;
-    unsigned char A;
+    salt_stats = stats;
+    clock = stats ? stat_clock() : 0;
 
-    // create debris
+    // create settled debris of every opaque pixel, bottom up and from both sides to the middle:
+    // by distance to the nearer edge, the left one first
     for (unsigned int row=shape[0]-1; row < shape[0]; row--) {
-        for (unsigned int col=0; col < shape[1]/2; col++) {
-            i = (row * stride[0]) + (col * stride[1]);
-            A = reference[i+3];
-            if (A > ALPHA_THRESHOLD) {
-                debris_arr[total_debris].R = reference[i];
-                debris_arr[total_debris].G = reference[i+1];
-                debris_arr[total_debris].B = reference[i+2];
-                debris_arr[total_debris].A = A;
-                debris_arr[total_debris].active = 0;
-                debris_arr[total_debris].row = (double)row;
-                debris_arr[total_debris].col = (double)col;
-                debris_arr[total_debris].row_velocity = 0;
-                debris_arr[total_debris].col_velocity = 0;
-                total_debris++;
-            } else {
-                reference[i+3] = 0;
-            }
-            i = (row * stride[0]) + ((shape[1]-col-1) * stride[1]);
-            A = reference[i+3];
-            if (A > ALPHA_THRESHOLD) {
-                debris_arr[total_debris].R = reference[i];
-                debris_arr[total_debris].G = reference[i+1];
-                debris_arr[total_debris].B = reference[i+2];
-                debris_arr[total_debris].A = A;
-                debris_arr[total_debris].active = 0;
-                debris_arr[total_debris].row = (double)row;
-                debris_arr[total_debris].col = (double)(shape[1]-col-1);
-                debris_arr[total_debris].row_velocity = 0;
-                debris_arr[total_debris].col_velocity = 0;
-                total_debris++;
-            } else {
-                reference[i+3] = 0;
-            }
-        }
-        if ((shape[1] % 2) == 1) {
-            // odd
-            i = (row * stride[0]) + ((shape[1]/2) * stride[1]);
-            A = reference[i+3];
-            if (A > ALPHA_THRESHOLD) {
-                debris_arr[total_debris].R = reference[i];
-                debris_arr[total_debris].G = reference[i+1];
-                debris_arr[total_debris].B = reference[i+2];
-                debris_arr[total_debris].A = A;
-                debris_arr[total_debris].active = 0;
-                debris_arr[total_debris].row = (double)row;
-                debris_arr[total_debris].col = (double)(shape[1]/2);
-                debris_arr[total_debris].row_velocity = 0;
-                debris_arr[total_debris].col_velocity = 0;
-                total_debris++;
-            } else {
-                reference[i+3] = 0;
-            }
-        }
-    }
-
-    // draw initial frame
-    for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
-        draw_debris(debris_arr, debris_counter, ret, 0, stride, 255);
-    }
-
-    for (unsigned int fc=1; fc < frames; fc++) {
-        //printf("%u\n", fc);
-        current_offset = fc * MAX_INDEX;
-        for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
-            update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
-            update_debris(debris_arr, total_debris, debris_counter, active_ref, shape, stride, active, fc);
-        }
-        // draw all debris
-        for (debris_counter=0; debris_counter < total_debris; debris_counter++) {
-            draw_debris(debris_arr, debris_counter, ret, current_offset, stride, 255);
+        count = opaque_cols(reference + row * stride[0], shape[1], stride[1], cols);
+        for (int lo=0, hi=(int)count-1; lo <= hi;) {
+            col = (cols[lo] <= shape[1] - 1 - cols[hi]) ? cols[lo++] : cols[hi--];
+            add_debris(debris_arr, &total_debris, reference, row * stride[0] + col * stride[1], row, col, 0, 0, 0);
         }
     }
+    STAT_PHASE(spawn_seconds, clock);
 
-    free(debris_arr);
+    debris_frames(0, debris_arr, total_debris, active, active_ref, shape, stride, ret, frame_stride, frames, clock);
+    salt_stats = NULL;
 }
@@ -1,3 +1,22 @@
+// alpha a pixel needs to be more than to be part of the image, also read by py_cffi_salt
+#define ALPHA_THRESHOLD 100
+
+/*
+ * optional work counters, pass NULL to skip counting.
+ * every entry point adds to the struct, it is not reset
+ */
+struct salt_stats{
+    unsigned long long particles_created;
+    unsigned long long update_calls;
+    unsigned long long fill_probes;
+    unsigned long long active_probes;
+    double spawn_seconds, simulate_seconds, draw_seconds;
+};
+typedef struct salt_stats SaltStats;
+
+// frees the scratch memory of the calling thread when it's larger than is kept between requests
+void scratch_release(void);
+
 void c_particles(unsigned char* ,
                  unsigned int [],
                  unsigned int [],
@@ -5,28 +24,75 @@ void c_particles(unsigned char* ,
                  unsigned int,
                  unsigned int,
                  unsigned int,
-                 unsigned int);
+                 unsigned int,
+                 unsigned int,
+                 SaltStats *);
 
 void c_debris(int *,
-              unsigned char *,
+              const unsigned char *,
               unsigned char *,
               unsigned int [],
               unsigned int [],
               unsigned char*,
               unsigned int,
-              unsigned int);
+              unsigned int,
+              unsigned int,
+              SaltStats *);
 
-void c_dust(unsigned char*,
+void c_dust(const unsigned char*,
             unsigned int [],
             unsigned int [],
             unsigned int,
             unsigned int,
-            unsigned char*);
+            unsigned char*,
+            unsigned int,
+            SaltStats *);
 
 void c_crumble(int*,
                unsigned char *,
-               unsigned char *,
+               const unsigned char *,
                unsigned int [],
                unsigned int [],
                unsigned char*,
-               unsigned int);
+               unsigned int,
+               unsigned int,
+               SaltStats *);
+
+// a frame with every pixel as a scale x scale block, for simulations run at a reduced size
+void c_expand(const unsigned char *,
+              unsigned int [],
+              unsigned int [],
+              unsigned int,
+              unsigned char *);
+
+/*
+ * one dust of the closed form dust, all its path depends on. Filled by c_dust_paths,
+ * c_dust_frames draws any frames of it, in any order and on any thread
+ */
+struct dust_path{
+    unsigned long long key;
+    double velocity;
+    unsigned int row, col;
+    // frame it starts moving in, moves until it reaches top speed
+    unsigned int start, speedup;
+    unsigned char R, G, B, A;
+};
+typedef struct dust_path DustPath;
+
+unsigned int c_dust_paths(const unsigned char*,
+                          unsigned int [],
+                          unsigned int [],
+                          unsigned int,
+                          DustPath*,
+                          SaltStats *);
+
+void c_dust_frames(const DustPath*,
+                   unsigned int,
+                   unsigned int [],
+                   unsigned int [],
+                   unsigned int,
+                   unsigned int,
+                   unsigned int,
+                   unsigned char*,
+                   unsigned int,
+                   SaltStats *);
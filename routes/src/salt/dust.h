@@ -1,6 +1,10 @@
 #ifndef HEADER_DUST
 #define HEADER_DUST
 
+#include <math.h>
+
+#include "salt.h"
+
 struct dust{
     double row, col, x_velocity;
     unsigned char R, G, B, A;
@@ -8,7 +12,139 @@ struct dust{
 };
 typedef struct dust Dust;
 
-void update_dust(Dust*, unsigned int, int, int, unsigned int[]);
-void draw_dust(Dust*, unsigned int, unsigned char*, unsigned int, unsigned int[], unsigned int[]);
-char in_array(unsigned int, unsigned int, unsigned int[]);
+// x velocity of a moving dust goes up by DUST_ACCELERATION a frame until DUST_TOP_SPEED
+# define DUST_TOP_SPEED 13.0
+# define DUST_ACCELERATION 0.08
+
+KERNEL char in_array(unsigned int row, unsigned int col, unsigned int shape[]) {
+    return ((row >= 0) && (row < shape[0]) && (col >= 0) && (col < shape[1])) ? 1:0;
+}
+
+KERNEL void update_dust(Dust* dusts, unsigned int dust_num, int max_col, int min_col, unsigned int shape[]) {
+    STAT_ADD(update_calls, 1);
+    int col = dusts[dust_num].col;
+    if (dusts[dust_num].active > 0){
+        // active, randomly move direction
+        //int col_rand = (int)(shape[1]/50), col_offset = 1;
+        double row_offset = shape[0]/40;
+        int row_rand = (int)(row_offset*2+1);
+        // check for 0 div errors
+        if (row_rand == 0) {
+            row_rand = 3;
+            row_offset = 1;
+        }
+        /*if (col_rand == 0) {
+            col_rand = shape[1]/20;
+        }*/
+        dusts[dust_num].row += (double)(rand() % row_rand) - row_offset;
+        dusts[dust_num].col += dusts[dust_num].x_velocity;
+        if (dusts[dust_num].x_velocity < DUST_TOP_SPEED) {
+            dusts[dust_num].x_velocity += DUST_ACCELERATION;
+        }
+
+    } else if (col > max_col) {
+        // force active
+        dusts[dust_num].active++;
+        dusts[dust_num].x_velocity = (double)(rand() % 200)/400 + 1;
+    } else if (col > min_col) {
+        int chance = rand() % (max_col - min_col);
+        if (chance < (col - min_col)) {
+            dusts[dust_num].active++;
+            dusts[dust_num].x_velocity = (double)(rand() % 200)/400 + 1;
+        }
+    }
+}
+
+KERNEL void draw_dust(Dust* dusts, unsigned int dust_num, unsigned char* arr, unsigned int offset, unsigned int shape[], unsigned int stride[]) {
+    int row = (int)dusts[dust_num].row, col = (int)dusts[dust_num].col;
+    if (in_array(row, col, shape) == 1) {
+        // draw
+        unsigned int index = rowcol_to_index(row, col, stride, offset);
+        arr[index] = dusts[dust_num].R;
+        arr[index+1] = dusts[dust_num].G;
+        arr[index+2] = dusts[dust_num].B;
+        arr[index+3] = dusts[dust_num].A;
+    }
+}
+
+/*
+ * Closed form dust: where update_dust would have a dust after any number of frames, straight
+ * from its DustPath. The same sweep decides the frame it starts moving in, dust_start draws
+ * its chances from its own key by frame number instead of rand().
+ */
+KERNEL unsigned int dust_start(unsigned int col, int max_col, int range, uint64_t key, unsigned int frames) {
+    // update_dust's sweep in frame fc is max_col - 2*(fc-1), a sure start once col is past it
+    int gap = max_col - (int)col;
+    unsigned int forced = gap/2 + 2, fc = (gap < range) ? 1 : (gap - range)/2 + 2;
+
+    for (; fc < forced && fc < frames; fc++) {
+        int min_col = max_col - range - 2*((int)fc - 1);
+        if ((int)RANDOM_RANGE(random_at(key, fc), 32, range) < (int)col - min_col) {
+            return fc;
+        }
+    }
+    return forced;
+}
+
+KERNEL double dust_col(const DustPath* path, unsigned int moves) {
+    // the speed goes up after every move until top speed, a sum of an arithmetic series
+    double steps = (moves <= path->speedup)
+        ? (double)moves * (moves - 1) / 2
+        : (double)path->speedup * (path->speedup + 1) / 2 + (double)path->speedup * (moves - 1 - path->speedup);
+    return path->col + moves * path->velocity + DUST_ACCELERATION * steps;
+}
+
+/*
+ * Rows moved in `moves` moves of sd sigma each. The walk is built top down as a Brownian bridge
+ * over [0, span): the end, then the middle of every half given its ends, one draw per point
+ * keyed by its move number. Any point takes at most log2(span) draws and all agree with each other.
+ */
+KERNEL double dust_walk(uint64_t key, unsigned int moves, unsigned int span, double sigma) {
+    unsigned int lo = 0, hi = span, mid;
+    double at_lo = 0, at_hi = random_normal(random_at(key, span)) * sigma * sqrt((double)span), at_mid;
+    // sd of a middle given the ends, half of the sd over the whole interval
+    double scale = sigma * sqrt((double)span) / 2;
+
+    while (moves != lo) {
+        if (moves == hi) {
+            return at_hi;
+        }
+        mid = lo + (hi - lo)/2;
+        at_mid = (at_lo + at_hi) / 2 + random_normal(random_at(key, mid)) * scale;
+        if (moves < mid) {
+            hi = mid;
+            at_hi = at_mid;
+        } else {
+            lo = mid;
+            at_lo = at_mid;
+        }
+        scale *= M_SQRT1_2;
+    }
+    return at_lo;
+}
+
+KERNEL void draw_dust_path(const DustPath* path, unsigned int frame, unsigned int span, double sigma, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
+    int row = path->row, col = path->col;
+    if (frame > path->start) {
+        unsigned int moves = frame - path->start;
+        double at = dust_col(path, moves);
+        // only ever moves right, gone for good
+        if (at >= shape[1]) {
+            return;
+        }
+        col = (int)at;
+        row = (int)(path->row + dust_walk(path->key, moves, span, sigma));
+    }
+    if (in_array(row, col, shape) == 1) {
+        unsigned int index = rowcol_to_index(row, col, stride, 0);
+        arr[index] = path->R;
+        arr[index+1] = path->G;
+        arr[index+2] = path->B;
+        arr[index+3] = path->A;
+    }
+}
+
+void update_dusts(Dust*, unsigned int, int, int, unsigned int[]);
+void draw_dusts(Dust*, unsigned int, unsigned char*, unsigned int, unsigned int[], unsigned int[]);
+void draw_dust_paths(const DustPath*, unsigned int, unsigned int, unsigned int, double, unsigned char*, unsigned int[], unsigned int[]);
 #endif
@@ -1,11 +1,78 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, Literal, Optional
+
+import os
+import threading
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
 
 import numpy as np
 
 from .cffi_salt import ffi, lib
 from ...utils.function_utils import in_executor
+from ...utils.buffer_pool import pool_empty, pool_zeros
+from ...utils.frame_store import frame_stack
+from ...utils.metrics import span, add_info, add_counters, current_timer
+
+if TYPE_CHECKING:
+    from typing import Iterator
+
+
+__all__ = (
+    'active_isa', 'draw_particles', 'draw_debris', 'draw_dust', 'dust_frames', 'draw_crumble', 'dust_padding',
+    'crumble_padding', 'expand_frames', 'DustMode', 'SimScale',
+)
+
+# stepped simulates every dust frame by frame, closed computes each frame on its own
+DustMode = Literal['stepped', 'closed']
+# how much bigger than the simulation grid the frames come out
+SimScale = Literal[1, 2, 4]
+# frames per native call of the closed form dust, and threads drawing them. The threads are
+# shared by every request of the process, the scheduler admits a dust request as one job and
+# this keeps the native threads on top of its jobs at DUST_WORKERS
+DUST_CHUNK = 8
+DUST_WORKERS = min(4, os.cpu_count() or 1)
+
+_dust_pool: Optional[ThreadPoolExecutor] = None
+_dust_pool_lock = threading.Lock()
+
+
+def _get_dust_pool() -> ThreadPoolExecutor:
+    global _dust_pool
+    with _dust_pool_lock:
+        if _dust_pool is None:
+            _dust_pool = ThreadPoolExecutor(DUST_WORKERS, thread_name_prefix='dust')
+        return _dust_pool
+
+
+def active_isa() -> str:
+    """The instruction set the multiversioned kernels run with, picked at import."""
+    return ffi.string(lib.active_isa()).decode()
+
+
+def _buffer(arr: np.ndarray, ctype: str = 'unsigned char []'):
+    # arrays are handed to C as is, from_buffer refuses anything non-contiguous or read-only
+    return ffi.from_buffer(ctype, arr, require_writable=True)
+
+
+def _geometry(arr: np.ndarray):
+    return ffi.new("unsigned int []", arr.shape), ffi.new("unsigned int []", arr.strides)
 
 
-__all__ = ('draw_particles', 'draw_debris', 'draw_dust', 'draw_crumble')
+STAT_FIELDS = (
+    'particles_created', 'update_calls', 'fill_probes', 'active_probes',
+    'spawn_seconds', 'simulate_seconds', 'draw_seconds',
+)
+
+
+def _stats():
+    # only count inside a request, the kernels skip counting on NULL
+    return ffi.new('SaltStats *') if current_timer() is not None else ffi.NULL
+
+
+def _record(stats):
+    if stats != ffi.NULL:
+        add_counters({name: getattr(stats, name) for name in STAT_FIELDS})
 
 
 def draw_particles(
@@ -16,130 +83,180 @@ def draw_particles(
     skip: int = 2,
     particle_type: int = 0
 ) -> np.ndarray:
-    ref = arr.copy()
-    ref.flags.writeable = True
-    ret = np.array([arr.copy() for _ in range(frames)], dtype=np.uint8)
-    ret.flags.writeable = True
-
-    retp= ffi.cast("char *", ret.ctypes.data)
-    refp = ffi.cast("char *", ref.ctypes.data)
-    shape = ffi.new("unsigned int []", ref.shape)
-    stride = ffi.new("unsigned int []", ref.strides)
-
-    lib.c_particles(refp, shape, stride, retp, frames, new_particles, skip, particle_type)
+    """``arr`` is used as the simulation buffer and is modified"""
+    # every frame is initialized from arr on the C side
+    ret = frame_stack([frames, *arr.shape], zeroed=False)
+    shape, stride = _geometry(arr)
+    stats = _stats()
+
+    with span('kernel'):
+        lib.c_particles(
+            _buffer(arr), shape, stride, _buffer(ret), ret.strides[0], frames, new_particles, skip, particle_type, stats
+        )
+    # the thread may sit idle after this, a block larger than most requests need goes back
+    lib.scratch_release()
+    _record(stats)
+    add_info(frames=frames)
 
     return ret
 
 
-@in_executor()
+@in_executor(process=True)
 def draw_debris(
     arr: np.ndarray,
     *,
     num_frames: int = 75,
     percent: int = 100
 ) -> np.ndarray:
-    active_arr = np.zeros([*arr.shape[:2]], dtype=int)
-    active_arr.flags.writeable = True
+    active_arr = pool_zeros(arr.shape[:2], np.intc)
+
+    active_ref = pool_zeros(arr.shape)
+
+    ret = frame_stack([num_frames, *arr.shape])
+
+    shape, stride = _geometry(arr)
+    stats = _stats()
+
+    with span('kernel'):
+        lib.c_debris(
+            _buffer(active_arr, 'int []'),
+            _buffer(arr),
+            _buffer(active_ref),
+            shape,
+            stride,
+            _buffer(ret),
+            ret.strides[0],
+            num_frames,
+            percent,
+            stats,
+        )
+    lib.scratch_release()
+    _record(stats)
+    add_info(frames=num_frames)
 
-    ref = arr.copy()
-    ref.flags.writeable = True
+    return ret
 
-    active_ref = np.zeros(ref.shape, dtype=np.uint8)
-    active_ref.flags.writeable = True
 
-    ret = np.zeros([num_frames, *arr.shape], dtype=np.uint8)
-    ret.flags.writeable = True
+def dust_padding(height: int, width: int) -> tuple[int, int, int, int]:
+    # (top, right, bottom, left) room for the dust to blow into
+    return height//5, width//4, height//5, width//10
 
-    activep = ffi.cast('int  *', active_arr.ctypes.data)
-    active_refp = ffi.cast('char  *', active_ref.ctypes.data)
-    refp = ffi.cast('char *', ref.ctypes.data)
-    retp = ffi.cast('unsigned char *', ret.ctypes.data)
 
-    shape = ffi.new("unsigned int []", ref.shape)
-    stride = ffi.new("unsigned int []", ref.strides)
+def crumble_padding(height: int, width: int) -> tuple[int, int, int, int]:
+    # (top, right, bottom, left) room for the sand to pile up
+    return 0, height//3, height//4, height//3
 
-    lib.c_debris(
-        activep,
-        refp,
-        active_refp,
-        shape,
-        stride,
-        retp,
-        num_frames,
-        percent,
-    )
 
-    return ret
+def _dust_frame_count(width: int) -> int:
+    return int(width * .7 + 25)
 
 
-@in_executor()
+@in_executor(process=True)
 def draw_dust(arr: np.ndarray) -> np.ndarray:
-    og_shape = arr.shape
-
-    side = np.zeros([og_shape[0], og_shape[1]//4, og_shape[2]], dtype=np.uint8)
-    short_side = np.zeros([og_shape[0], og_shape[1]//10, og_shape[2]], dtype=np.uint8)
-    arr = np.hstack([short_side, arr, side])
-
-    top = np.zeros([og_shape[0]//5, arr.shape[1], og_shape[2]], dtype=np.uint8)
-    arr = np.vstack([top, arr, top])
-
-    arr.flags.writeable = True
-    shape = arr.shape
+    """``arr`` should already be padded with ``dust_padding``"""
+    # one dust per pixel over ALPHA_THRESHOLD
+    max_dust = int(np.count_nonzero(arr[..., 3] > lib.ALPHA_THRESHOLD))
 
-    frames = int(shape[1]* .7 + 25)
+    frames = _dust_frame_count(arr.shape[1])
 
-    ret = np.zeros([frames, *shape], dtype=np.uint8)
-    ret.flags.writeable = True
+    ret = frame_stack([frames, *arr.shape])
 
-    arrp = ffi.cast('char *', arr.ctypes.data)
-    retp = ffi.cast('char *', ret.ctypes.data)
+    shape, stride = _geometry(arr)
+    stats = _stats()
 
-    shape = ffi.new("unsigned int []", arr.shape)
-    stride = ffi.new("unsigned int []", arr.strides)
-
-    lib.c_dust(arrp, shape, stride, int(og_shape[0]*og_shape[1]), frames, retp)
+    with span('kernel'):
+        lib.c_dust(_buffer(arr), shape, stride, max_dust, frames, _buffer(ret), ret.strides[0], stats)
+    lib.scratch_release()
+    _record(stats)
+    add_info(frames=frames, max_dust=max_dust)
 
     return ret
 
 
-@in_executor()
+def dust_frames(arr: np.ndarray) -> Iterator[np.ndarray]:
+    """The frames of the closed form dust of ``arr``, padded with ``dust_padding``, one at a time.
+
+    Where each dust is in any frame is worked out from the dust alone, so chunks of frames are
+    drawn on the ``DUST_WORKERS`` threads of the process, a few chunks ahead of the caller. Only those
+    chunks of RGBA frames are held, frames the caller doesn't get to are never drawn. What else grows
+    with the frame count is up to the caller, the gif and APNG writers of this API keep only the
+    encoded output.
+    """
+    max_dust = int(np.count_nonzero(arr[..., 3] > lib.ALPHA_THRESHOLD))
+    frames = _dust_frame_count(arr.shape[1])
+    paths = ffi.new('DustPath []', max(max_dust, 1))
+    shape, stride = _geometry(arr)
+    stats = _stats()
+
+    with span('kernel'):
+        total = lib.c_dust_paths(_buffer(arr), shape, stride, frames, paths, stats)
+    lib.scratch_release()
+    _record(stats)
+    add_info(frames=frames, max_dust=max_dust)
+
+    def draw(first: int):
+        last = min(first + DUST_CHUNK, frames)
+        chunk = pool_empty([last - first, *arr.shape])
+        # a struct per chunk, recorded by the caller's thread
+        chunk_stats = ffi.new('SaltStats *') if stats != ffi.NULL else ffi.NULL
+        lib.c_dust_frames(paths, total, shape, stride, frames, first, last, _buffer(chunk), chunk.strides[0], chunk_stats)
+        return chunk, chunk_stats
+
+    starts = iter(range(0, frames, DUST_CHUNK))
+    pool = _get_dust_pool()
+    pending = deque(pool.submit(draw, first) for _, first in zip(range(DUST_WORKERS + 1), starts))
+    try:
+        while pending:
+            chunk, chunk_stats = pending.popleft().result()
+            for first in starts:
+                pending.append(pool.submit(draw, first))
+                break
+            _record(chunk_stats)
+            yield from chunk
+    finally:
+        # chunks of a caller that stopped early aren't drawn for nothing
+        for future in pending:
+            future.cancel()
+
+
+@in_executor(process=True)
 def draw_crumble(arr: np.ndarray) -> np.ndarray:
-    shape = arr.shape
-    side = np.zeros([shape[0], shape[0]//3, shape[2]], dtype=np.uint8)
-    arr = np.hstack([side, arr, side])
-    shape = arr.shape
-    bottom = np.zeros([shape[0]//4, shape[1], shape[2]], dtype=np.uint8)
-    arr = np.vstack([arr, bottom])
-
-    ref = arr.copy()
-    ref.flags.writeable = True
-
-    active_arr = np.zeros([*arr.shape[:2]], dtype=int)
-    active_arr.flags.writeable = True
-
-    active_ref = np.zeros(ref.shape, dtype=np.uint8)
-    active_ref.flags.writeable = True
-
-    num_frames = int(arr.shape[0]/2 + shape[1]/4)
-
-    ret = np.zeros([num_frames, *arr.shape], dtype=np.uint8)
-    ret.flags.writeable = True
-
-    active_arrp = ffi.cast('int *', active_arr.ctypes.data)
-    active_refp = ffi.cast('char *', active_ref.ctypes.data)
-    refp = ffi.cast('char *', ref.ctypes.data)
-    retp = ffi.cast('char *', ret.ctypes.data)
-
-    shape = ffi.new("unsigned int []", ref.shape)
-    stride = ffi.new("unsigned int []", ref.strides)
-
-    lib.c_crumble(
-        active_arrp,
-        active_refp,
-        refp,
-        shape,
-        stride,
-        retp,
-        num_frames,
-    )
+    """``arr`` should already be padded with ``crumble_padding``"""
+    active_arr = pool_zeros(arr.shape[:2], np.intc)
+
+    active_ref = pool_zeros(arr.shape)
+
+    num_frames = int(arr.shape[0]/2 + arr.shape[1]/4)
+
+    ret = frame_stack([num_frames, *arr.shape])
+
+    shape, stride = _geometry(arr)
+    stats = _stats()
+
+    with span('kernel'):
+        lib.c_crumble(
+            _buffer(active_arr, 'int []'),
+            _buffer(active_ref),
+            _buffer(arr),
+            shape,
+            stride,
+            _buffer(ret),
+            ret.strides[0],
+            num_frames,
+            stats,
+        )
+    lib.scratch_release()
+    _record(stats)
+    add_info(frames=num_frames)
     return ret
+
+
+def expand_frames(frames: np.ndarray, scale: int) -> Iterator[np.ndarray]:
+    """The frames of a stack with every pixel as a ``scale`` x ``scale`` block, one at a time.
+    A kernel runs on the small grid and only the frame being encoded is ever full size."""
+    shape, stride = _geometry(frames[0])
+    height, width, channels = frames.shape[1:]
+    for frame in frames:
+        out = pool_empty([height * scale, width * scale, channels])
+        lib.c_expand(_buffer(frame), shape, stride, scale, _buffer(out))
+        yield out
@@ -1,13 +1,83 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "salt.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+_Thread_local SaltStats *salt_stats = NULL;
+
+/*
+ * Per thread scratch memory of the entry points. The block is kept for the next call on the
+ * same thread instead of a malloc/free (and fresh page faults) of a few MB per request. It grows
+ * to the next power of two, and is given back after SCRATCH_TRIM_CALLS calls in a row that needed
+ * less than a quarter of it. scratch_release after a request keeps at most SCRATCH_KEEP on a
+ * thread that goes idle.
+ */
+# define SCRATCH_MIN (64 * 1024)
+# define SCRATCH_KEEP (2 * 1024 * 1024)
+# define SCRATCH_TRIM_CALLS 32
+
+struct scratch{
+    void *base;
+    size_t size;
+    unsigned int small_calls;
+};
+static _Thread_local struct scratch scratch = {NULL, 0, 0};
+
 void init_srand() {
     srand(time(NULL));
 }
 
+double stat_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void scratch_free(void) {
+    free(scratch.base);
+    scratch.base = NULL;
+    scratch.size = 0;
+    scratch.small_calls = 0;
+}
+
+void scratch_release(void) {
+    if (scratch.size > SCRATCH_KEEP) {
+        scratch_free();
+    }
+}
+
+// NULL if out of memory. Only one block per thread: the previous one is invalid after this
+void* scratch_get(size_t size) {
+    size_t want = SCRATCH_MIN;
+
+    if (scratch.base != NULL && size <= scratch.size / 4) {
+        if (++scratch.small_calls >= SCRATCH_TRIM_CALLS) {
+            scratch_free();
+        }
+    } else {
+        scratch.small_calls = 0;
+    }
+    if (scratch.base != NULL && size <= scratch.size) {
+        return scratch.base;
+    }
+
+    while (want < size) {
+        want *= 2;
+    }
+    // the old contents are never needed, no realloc copy
+    free(scratch.base);
+    scratch.base = malloc(want);
+    scratch.size = (scratch.base != NULL) ? want : 0;
+    scratch.small_calls = 0;
+    return scratch.base;
+}
+
 void range_sample(unsigned int *output, unsigned int max, unsigned int k) {
     unsigned int i = 0, j;
 
@@ -22,190 +92,68 @@ void range_sample(unsigned int *output, unsigned int max, unsigned int k) {
     }
 }
 
-unsigned char get_color(unsigned int type) {
-    if (type == 1) {
-        // pepper
-        unsigned char colors[] = {20, 40, 80, 100};
-        unsigned int weights[] = {2, 3, 3, 2};
-        unsigned int sum_weights = 0;
-        for (int i=0; i<4; i++) {
-            sum_weights += weights[i];
-        }
-        unsigned int rnd = rand() % sum_weights;
-
-        for (int i=0; i<4; i++) {
-           if (rnd < weights[i]) {
-                return colors[i];
-           }
-            rnd -= weights[i];
-        }
-    }else if (type == 0) {
-        // salt
-        unsigned char colors[] = {255, 220, 180, 140};
-        unsigned int weights[] = {5, 3, 1, 1};
-        unsigned int sum_weights = 0;
-        for (int i=0; i<4; i++) {
-            sum_weights += weights[i];
-        }
-        unsigned int rnd = rand() % sum_weights;
-
-        for (int i=0; i<4; i++) {
-            if (rnd < weights[i]) {
-                return colors[i];
+/*
+ * Columns of one row with alpha over ALPHA_THRESHOLD, in order, into cols. Returns how many.
+ * RGBA rows are compared 16 pixels at a time with SSE2 (every x86-64 has it), so the
+ * transparent padding around an image costs a compare per 16 pixels.
+ */
+unsigned int opaque_cols(const unsigned char *row, unsigned int width, unsigned int pixel_stride, unsigned int *cols) {
+    unsigned int count = 0, col = 0, mask;
+
+#ifdef __SSE2__
+    if (pixel_stride == 4) {
+        const __m128i threshold = _mm_set1_epi32(ALPHA_THRESHOLD);
+        for (; col + 16 <= width; col += 16) {
+            const __m128i *pixels = (const __m128i *)(row + (size_t)col * 4);
+            // alpha is the high byte of a little endian RGBA pixel
+            __m128i a0 = _mm_cmpgt_epi32(_mm_srli_epi32(_mm_loadu_si128(pixels), 24), threshold);
+            __m128i a1 = _mm_cmpgt_epi32(_mm_srli_epi32(_mm_loadu_si128(pixels + 1), 24), threshold);
+            __m128i a2 = _mm_cmpgt_epi32(_mm_srli_epi32(_mm_loadu_si128(pixels + 2), 24), threshold);
+            __m128i a3 = _mm_cmpgt_epi32(_mm_srli_epi32(_mm_loadu_si128(pixels + 3), 24), threshold);
+            mask = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+            if (mask == 0xFFFF) {
+                // inside a solid image
+                for (unsigned int k = 0; k < 16; k++) {
+                    cols[count + k] = col + k;
+                }
+                count += 16;
+                continue;
+            }
+            while (mask) {
+                cols[count++] = col + (unsigned int)__builtin_ctz(mask);
+                mask &= mask - 1;
             }
-            rnd -= weights[i];
         }
-    } else if (type == 2){
-        // water?
-        return (unsigned char)255;
-    } else {
-        // mystery???
-        return (unsigned char)127;
-    }
-    return (unsigned char)127;
-}
-
-unsigned int rowcol_to_index(unsigned int row, unsigned int col, unsigned int stride[], unsigned int offset) {
-    return (row * stride[0]) + (col * stride[1]) + offset;
-}
-
-unsigned char is_filled(unsigned int row, unsigned int col, unsigned char* arr, unsigned int offset, unsigned int stride[]) {
-    unsigned int index = rowcol_to_index(row, col, stride, offset);
-    // increase by 3 to get A of RGBA
-    index += 3;
-    return (unsigned char)(arr[index]);
-}
-
-void draw_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
-    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
-    unsigned int index = rowcol_to_index(row, col, stride, offset);
-    unsigned char color = (fill > 0) ? particles[particle_number].color : (unsigned char) 0;
-    for (unsigned int current_index = index; current_index < index + 3; current_index++) {
-        arr[current_index] = color;
-    }
-    arr[index+3] = (unsigned char)fill;
-}
-
-void draw_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
-    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
-    unsigned int index = rowcol_to_index(row, col, stride, offset);
-    unsigned char color = particles[particle_number].color;
-    arr[index] = 0;
-    arr[index+1] = (unsigned char)(color/3);
-    arr[index+2] = (unsigned char)color;
-    arr[index+3] = (unsigned char)fill;
-}
-
-void draw_piss(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
-    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
-    unsigned int index = rowcol_to_index(row, col, stride, offset);
-    arr[index] = (unsigned char) 222;
-    arr[index+1] = (unsigned char)234;
-    arr[index+2] = (unsigned char)20;
-    arr[index+3] = (unsigned char)fill;
-}
-
-void update_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
-    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
-    row++;
-    if (row >= shape[0]) {
-        // already hit the bottom of the image
-        return;
     }
-
-    // check spot right below
-    if (is_filled(row, col, arr, 0, stride) < ALPHA_THRESHOLD) {
-        // directly below is empty, move down
-        draw_sand(particles, particle_number, arr, 0, stride, 0);
-        particles[particle_number].row = row;
-        particles[particle_number].col = col;
-    }else {
-        // below is filled, check left and right
-        unsigned char left, right;
-        right = (col < shape[1]-1) ? is_filled(row, col+1, arr, 0, stride) : 255;
-        left = (col > 0 ) ? is_filled(row, col-1, arr, 0, stride) : 255;
-        if (right >= ALPHA_THRESHOLD && left >= ALPHA_THRESHOLD) {
-            // both filled
-            // stay in current position
-            return;
-        }else if (right < ALPHA_THRESHOLD) {
-            // right is open, move to the right
-            draw_sand(particles, particle_number, arr, 0, stride, 0);
-            particles[particle_number].row = row;
-            particles[particle_number].col = col + 1;
-        }else if (left < ALPHA_THRESHOLD) {
-            // left is open, move to the left
-            draw_sand(particles, particle_number, arr, 0, stride, 0);
-            particles[particle_number].row = row;
-            particles[particle_number].col = col - 1;
+#endif
+    for (; col < width; col++) {
+        if (row[(size_t)col * pixel_stride + 3] > ALPHA_THRESHOLD) {
+            cols[count++] = col;
         }
     }
-    draw_sand(particles, particle_number, arr, 0, stride, 255);
+    return count;
 }
 
-void update_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
-    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
-    if ((row+1) >= shape[0]) {
-        // already hit the bottom of the image
-        return;
-    }
-    row++;
-    // check spot right below
-    if (is_filled(row, col, arr, 0, stride) < ALPHA_THRESHOLD) {
-        // directly below is empty, move down
-        draw_liquid(particles, particle_number, arr, 0, stride, 0);
-        particles[particle_number].row = row;
-        particles[particle_number].col = col;
-    }else {
-        // below is filled, check left and right
-        unsigned char left, right;
-        unsigned char space_checker;
-
-        // check down right/down left 4? pixels
-        for (space_checker=1; space_checker < 5; space_checker++){
-            right = (col < (shape[1]-space_checker)) ? is_filled(row, col+space_checker, arr, 0, stride) : 255;
-            left = (col >= space_checker) ? is_filled(row, col-space_checker, arr, 0, stride) : 255;
-            if (right < ALPHA_THRESHOLD) {
-                // right is open, move to the right
-                draw_liquid(particles, particle_number, arr, 0, stride, 0);
-                particles[particle_number].row = row;
-                particles[particle_number].col = col + space_checker;
-                draw_liquid(particles, particle_number, arr, 0, stride, 255);
-                return;
-            }else if (left < ALPHA_THRESHOLD) {
-                // left is open, move to the left
-                draw_liquid(particles, particle_number, arr, 0, stride, 0);
-                particles[particle_number].row = row;
-                particles[particle_number].col = col - space_checker;
-                draw_liquid(particles, particle_number, arr, 0, stride, 255);
-                return;
+/*
+ * One RGBA frame with every pixel as a scale x scale block, into the contiguous dst of
+ * shape[0]*scale rows of shape[1]*scale pixels. The first copy of a row is built pixel by
+ * pixel, the other scale-1 are copies of it.
+ */
+void c_expand(const unsigned char *src, unsigned int shape[], unsigned int stride[], unsigned int scale, unsigned char *dst) {
+    size_t row_bytes = (size_t)shape[1] * scale * 4;
+    uint32_t pixel;
+
+    for (unsigned int row = 0; row < shape[0]; row++) {
+        const unsigned char *from = src + (size_t)row * stride[0];
+        unsigned char *to = dst + (size_t)row * scale * row_bytes;
+        for (unsigned int col = 0; col < shape[1]; col++) {
+            memcpy(&pixel, from + (size_t)col * stride[1], 4);
+            for (unsigned int k = 0; k < scale; k++) {
+                memcpy(to + ((size_t)col * scale + k) * 4, &pixel, 4);
             }
         }
-
-        // check directly right/left
-        row--;
-        // check right/left 3? pixels
-        for (space_checker=1; space_checker < 4; space_checker++){
-            right = (col < (shape[1]-space_checker)) ? is_filled(row, col+space_checker, arr, 0, stride) : 255;
-            left = (col >= space_checker) ? is_filled(row, col-space_checker, arr, 0, stride) : 255;
-            if (right < ALPHA_THRESHOLD) {
-                // right is open, move to the right
-                draw_liquid(particles, particle_number, arr, 0, stride, 0);
-                particles[particle_number].row = row;
-                particles[particle_number].col = col + space_checker;
-                draw_liquid(particles, particle_number, arr, 0, stride, 255);
-                return;
-            }else if (left < ALPHA_THRESHOLD) {
-                // left is open, move to the left
-                draw_liquid(particles, particle_number, arr, 0, stride, 0);
-                particles[particle_number].row = row;
-                particles[particle_number].col = col - space_checker;
-                draw_liquid(particles, particle_number, arr, 0, stride, 255);
-                return;
-            }
+        for (unsigned int k = 1; k < scale; k++) {
+            memcpy(to + k * row_bytes, to, row_bytes);
         }
-
     }
-
-    draw_liquid(particles, particle_number, arr, 0, stride, 255);
 }
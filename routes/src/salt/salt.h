@@ -1,23 +1,256 @@
 #ifndef HEADER_SALT
 #define HEADER_SALT
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "c_particles.h"
+
 struct particle{
     unsigned int row, col;
     unsigned char color;
 };
 typedef struct particle Particle;
 
-# define ALPHA_THRESHOLD 100
+/*
+ * Material kernels, inlined into the engine in c_particles.c. The driver there is expanded once
+ * per material with the material as a constant, so there are no calls left in the frame loops
+ * and every check of the material folds away.
+ */
+# define KERNEL static inline __attribute__((always_inline))
+
+// stats of the entry point running on this thread, NULL when not counting
+extern _Thread_local SaltStats *salt_stats;
+
+# define STAT_ADD(field, n) do { if (salt_stats) salt_stats->field += (n); } while (0)
+// add the time since `since` to a phase and restart the clock
+# define STAT_PHASE(field, since) do { \
+    if (salt_stats) { double _now = stat_clock(); salt_stats->field += _now - (since); (since) = _now; } \
+} while (0)
 
 void init_srand();
+void* scratch_get(size_t size);
+double stat_clock(void);
 void range_sample(unsigned int *output, unsigned int max, unsigned int k);
-unsigned char get_color(unsigned int type);
-unsigned int rowcol_to_index(unsigned int row, unsigned int col, unsigned int stride[], unsigned int offset);
-unsigned char is_filled(unsigned int row, unsigned int col, unsigned char* arr, unsigned int offset, unsigned int stride[]);
-void draw_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill);
-void draw_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill);
-void draw_piss(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill);
-void update_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]);
-void update_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]);
+unsigned int opaque_cols(const unsigned char *row, unsigned int width, unsigned int pixel_stride, unsigned int *cols);
+// seed of the counter based draws of one call, from rand() so srand still decides everything
+KERNEL uint64_t random_seed(void) {
+    uint64_t seed = (uint64_t)rand();
+    return (seed << 31) ^ (uint64_t)rand();
+}
+
+// draw number `counter` of `seed` (splitmix64), no state, any order and any thread
+KERNEL uint64_t random_at(uint64_t seed, uint64_t counter) {
+    uint64_t z = seed + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// `bits` bits of a draw scaled to [0, range)
+# define RANDOM_RANGE(draw, bits, range) ((unsigned int)((((draw) & ((1ULL << (bits)) - 1)) * (range)) >> (bits)))
+
+// about normal with sd 1 from a draw: its count of set bits is binomial(64, 1/2)
+KERNEL double random_normal(uint64_t draw) {
+    return (double)(__builtin_popcountll(draw) - 32) * 0.25;
+}
+
+// c_particles types, a grain material each
+# define GRAIN_SALT 0
+# define GRAIN_PEPPER 1
+# define GRAIN_WATER 2
+# define GRAIN_PISS 3
+
+KERNEL unsigned char get_color(unsigned int type) {
+    if (type == GRAIN_PEPPER) {
+        // pepper
+        unsigned char colors[] = {20, 40, 80, 100};
+        unsigned int weights[] = {2, 3, 3, 2};
+        unsigned int sum_weights = 0;
+        for (int i=0; i<4; i++) {
+            sum_weights += weights[i];
+        }
+        unsigned int rnd = rand() % sum_weights;
+
+        for (int i=0; i<4; i++) {
+           if (rnd < weights[i]) {
+                return colors[i];
+           }
+            rnd -= weights[i];
+        }
+    }else if (type == GRAIN_SALT) {
+        // salt
+        unsigned char colors[] = {255, 220, 180, 140};
+        unsigned int weights[] = {5, 3, 1, 1};
+        unsigned int sum_weights = 0;
+        for (int i=0; i<4; i++) {
+            sum_weights += weights[i];
+        }
+        unsigned int rnd = rand() % sum_weights;
+
+        for (int i=0; i<4; i++) {
+            if (rnd < weights[i]) {
+                return colors[i];
+            }
+            rnd -= weights[i];
+        }
+    } else if (type == GRAIN_WATER){
+        // water?
+        return (unsigned char)255;
+    } else {
+        // mystery???
+        return (unsigned char)127;
+    }
+    return (unsigned char)127;
+}
+
+KERNEL unsigned int rowcol_to_index(unsigned int row, unsigned int col, unsigned int stride[], unsigned int offset) {
+    return (row * stride[0]) + (col * stride[1]) + offset;
+}
+
+KERNEL unsigned char is_filled(unsigned int row, unsigned int col, unsigned char* arr, unsigned int offset, unsigned int stride[]) {
+    STAT_ADD(fill_probes, 1);
+    unsigned int index = rowcol_to_index(row, col, stride, offset);
+    // increase by 3 to get A of RGBA
+    index += 3;
+    return (unsigned char)(arr[index]);
+}
+
+KERNEL void draw_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
+    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
+    unsigned int index = rowcol_to_index(row, col, stride, offset);
+    unsigned char color = (fill > 0) ? particles[particle_number].color : (unsigned char) 0;
+    for (unsigned int current_index = index; current_index < index + 3; current_index++) {
+        arr[current_index] = color;
+    }
+    arr[index+3] = (unsigned char)fill;
+}
+
+KERNEL void draw_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
+    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
+    unsigned int index = rowcol_to_index(row, col, stride, offset);
+    unsigned char color = particles[particle_number].color;
+    arr[index] = 0;
+    arr[index+1] = (unsigned char)(color/3);
+    arr[index+2] = (unsigned char)color;
+    arr[index+3] = (unsigned char)fill;
+}
+
+KERNEL void draw_piss(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int offset, unsigned int stride[], unsigned char fill) {
+    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
+    unsigned int index = rowcol_to_index(row, col, stride, offset);
+    arr[index] = (unsigned char) 222;
+    arr[index+1] = (unsigned char)234;
+    arr[index+2] = (unsigned char)20;
+    arr[index+3] = (unsigned char)fill;
+}
+
+KERNEL void update_sand(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
+    STAT_ADD(update_calls, 1);
+    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
+    row++;
+    if (row >= shape[0]) {
+        // already hit the bottom of the image
+        return;
+    }
+
+    // check spot right below
+    if (is_filled(row, col, arr, 0, stride) < ALPHA_THRESHOLD) {
+        // directly below is empty, move down
+        draw_sand(particles, particle_number, arr, 0, stride, 0);
+        particles[particle_number].row = row;
+        particles[particle_number].col = col;
+    }else {
+        // below is filled, check left and right
+        unsigned char left, right;
+        right = (col < shape[1]-1) ? is_filled(row, col+1, arr, 0, stride) : 255;
+        left = (col > 0 ) ? is_filled(row, col-1, arr, 0, stride) : 255;
+        if (right >= ALPHA_THRESHOLD && left >= ALPHA_THRESHOLD) {
+            // both filled
+            // stay in current position
+            return;
+        }else if (right < ALPHA_THRESHOLD) {
+            // right is open, move to the right
+            draw_sand(particles, particle_number, arr, 0, stride, 0);
+            particles[particle_number].row = row;
+            particles[particle_number].col = col + 1;
+        }else if (left < ALPHA_THRESHOLD) {
+            // left is open, move to the left
+            draw_sand(particles, particle_number, arr, 0, stride, 0);
+            particles[particle_number].row = row;
+            particles[particle_number].col = col - 1;
+        }
+    }
+    draw_sand(particles, particle_number, arr, 0, stride, 255);
+}
+
+KERNEL void update_liquid(Particle* particles, unsigned int particle_number, unsigned char* arr, unsigned int shape[], unsigned int stride[]) {
+    STAT_ADD(update_calls, 1);
+    unsigned int row = particles[particle_number].row, col = particles[particle_number].col;
+    if ((row+1) >= shape[0]) {
+        // already hit the bottom of the image
+        return;
+    }
+    row++;
+    // check spot right below
+    if (is_filled(row, col, arr, 0, stride) < ALPHA_THRESHOLD) {
+        // directly below is empty, move down
+        draw_liquid(particles, particle_number, arr, 0, stride, 0);
+        particles[particle_number].row = row;
+        particles[particle_number].col = col;
+    }else {
+        // below is filled, check left and right
+        unsigned char left, right;
+        unsigned char space_checker;
+
+        // check down right/down left 4? pixels
+        for (space_checker=1; space_checker < 5; space_checker++){
+            right = (col < (shape[1]-space_checker)) ? is_filled(row, col+space_checker, arr, 0, stride) : 255;
+            left = (col >= space_checker) ? is_filled(row, col-space_checker, arr, 0, stride) : 255;
+            if (right < ALPHA_THRESHOLD) {
+                // right is open, move to the right
+                draw_liquid(particles, particle_number, arr, 0, stride, 0);
+                particles[particle_number].row = row;
+                particles[particle_number].col = col + space_checker;
+                draw_liquid(particles, particle_number, arr, 0, stride, 255);
+                return;
+            }else if (left < ALPHA_THRESHOLD) {
+                // left is open, move to the left
+                draw_liquid(particles, particle_number, arr, 0, stride, 0);
+                particles[particle_number].row = row;
+                particles[particle_number].col = col - space_checker;
+                draw_liquid(particles, particle_number, arr, 0, stride, 255);
+                return;
+            }
+        }
+
+        // check directly right/left
+        row--;
+        // check right/left 3? pixels
+        for (space_checker=1; space_checker < 4; space_checker++){
+            right = (col < (shape[1]-space_checker)) ? is_filled(row, col+space_checker, arr, 0, stride) : 255;
+            left = (col >= space_checker) ? is_filled(row, col-space_checker, arr, 0, stride) : 255;
+            if (right < ALPHA_THRESHOLD) {
+                // right is open, move to the right
+                draw_liquid(particles, particle_number, arr, 0, stride, 0);
+                particles[particle_number].row = row;
+                particles[particle_number].col = col + space_checker;
+                draw_liquid(particles, particle_number, arr, 0, stride, 255);
+                return;
+            }else if (left < ALPHA_THRESHOLD) {
+                // left is open, move to the left
+                draw_liquid(particles, particle_number, arr, 0, stride, 0);
+                particles[particle_number].row = row;
+                particles[particle_number].col = col - space_checker;
+                draw_liquid(particles, particle_number, arr, 0, stride, 255);
+                return;
+            }
+        }
+
+    }
+
+    draw_liquid(particles, particle_number, arr, 0, stride, 255);
+}
 
 #endif
@@ -0,0 +1,150 @@
+from __future__ import annotations
+from typing import Optional
+
+import os
+import time
+import weakref
+import threading
+
+import numpy as np
+
+__all__ = ('BufferPool', 'BUFFER_POOL', 'pool_empty', 'pool_zeros')
+
+# smaller arrays come straight from numpy, the allocator does fine with them
+MIN_POOLED = 256 * 1024
+
+
+def size_class(nbytes: int) -> int:
+    """Round up to 4 classes per power of two, at most 25% of a block is unused."""
+    step = max(1, 1 << max(0, nbytes.bit_length() - 3))
+    return -(-nbytes // step) * step
+
+
+class BufferPool:
+    """Big numpy buffers kept between requests of this process, so a frame stack of
+    several MB isn't allocated and page faulted in again on every request.
+
+    A block is handed out as a lease, an array over the block that isn't a view of it,
+    so every view of the lease, and every image made from one with ``Image.fromarray``,
+    keeps the lease alive. The block is free again when the lease is collected, nothing
+    has to be given back explicitly. Free blocks unused for ``idle`` seconds, and the
+    least recently used ones past ``max_bytes``, are dropped by a thread that checks
+    every ``idle / 2`` seconds, so they go even when no request comes anymore.
+    """
+
+    def __init__(self, max_bytes: int = 256 * 1024 * 1024, idle: float = 60.0):
+        self.max_bytes = max_bytes
+        self.idle = idle
+        # size class -> [[block, last used, leased]]
+        self._blocks: dict[int, list[list]] = {}
+        self._lock = threading.Lock()
+        self._trimmer: Optional[threading.Thread] = None
+        self.hits = 0
+        self.misses = 0
+
+    def _take(self, nbytes: int) -> tuple[np.ndarray, list]:
+        size = size_class(nbytes)
+        now = time.monotonic()
+        with self._lock:
+            for entry in self._blocks.get(size, ()):
+                if not entry[2]:
+                    entry[1] = now
+                    entry[2] = True
+                    self.hits += 1
+                    return entry[0], entry
+            entry = [np.empty(size, dtype=np.uint8), now, True]
+            self._blocks.setdefault(size, []).append(entry)
+            self.misses += 1
+            self._trim(now)
+            self._start_trimmer()
+            return entry[0], entry
+
+    @staticmethod
+    def _give_back(entry: list):
+        # a finalizer, runs wherever the lease is collected, the flag is written last
+        entry[1] = time.monotonic()
+        entry[2] = False
+
+    def _trim(self, now: float):
+        free = []
+        total = 0
+        for size, entries in self._blocks.items():
+            for entry in entries:
+                total += size
+                if not entry[2]:
+                    free.append((entry[1], size, entry))
+        # oldest first
+        free.sort(key=lambda f: f[0])
+        dropped = set()
+        for last_used, size, entry in free:
+            if total <= self.max_bytes and now - last_used < self.idle:
+                break
+            dropped.add(id(entry))
+            total -= size
+        if dropped:
+            blocks = {size: [e for e in entries if id(e) not in dropped] for size, entries in self._blocks.items()}
+            self._blocks = {size: entries for size, entries in blocks.items() if entries}
+
+    def trim(self):
+        with self._lock:
+            self._trim(time.monotonic())
+
+    def _start_trimmer(self):
+        # per process, a forked worker starts its own on its first block
+        if self._trimmer is not None and self._trimmer.is_alive():
+            return
+        pool = weakref.ref(self)
+        idle = self.idle
+
+        def run():
+            while True:
+                time.sleep(idle / 2)
+                alive = pool()
+                if alive is None:
+                    return
+                alive.trim()
+                del alive
+
+        self._trimmer = threading.Thread(target=run, name='buffer-pool-trim', daemon=True)
+        self._trimmer.start()
+
+    def empty(self, shape, dtype=np.uint8) -> np.ndarray:
+        dtype = np.dtype(dtype)
+        nbytes = int(np.prod(shape)) * dtype.itemsize
+        if nbytes < MIN_POOLED:
+            return np.empty(shape, dtype=dtype)
+        block, entry = self._take(nbytes)
+        # views of a view would point at the block itself, views of this point at the lease
+        lease = np.frombuffer(block.data, dtype=dtype, count=nbytes // dtype.itemsize)
+        weakref.finalize(lease, self._give_back, entry)
+        return lease.reshape(shape)
+
+    def zeros(self, shape, dtype=np.uint8) -> np.ndarray:
+        arr = self.empty(shape, dtype)
+        arr.fill(0)
+        return arr
+
+    def pooled_bytes(self) -> int:
+        with self._lock:
+            return sum(size * len(entries) for size, entries in self._blocks.items())
+
+
+def _pool_from_env() -> Optional[BufferPool]:
+    # ZNEITIZ_BUFFER_POOL_MB=0 turns pooling off
+    mb = int(os.environ.get('ZNEITIZ_BUFFER_POOL_MB', 256))
+    return BufferPool(mb * 1024 * 1024) if mb > 0 else None
+
+
+BUFFER_POOL = _pool_from_env()
+
+
+def pool_empty(shape, dtype=np.uint8) -> np.ndarray:
+    if BUFFER_POOL is None:
+        return np.empty(shape, dtype=dtype)
+    return BUFFER_POOL.empty(shape, dtype)
+
+
+def pool_zeros(shape, dtype=np.uint8) -> np.ndarray:
+    if BUFFER_POOL is None:
+        return np.zeros(shape, dtype=dtype)
+    return BUFFER_POOL.zeros(shape, dtype)
@@ -0,0 +1,119 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, Optional
+
+import os
+import mmap
+import tempfile
+import weakref
+
+import numpy as np
+from PIL import Image
+
+from .buffer_pool import pool_empty, pool_zeros
+
+if TYPE_CHECKING:
+    from typing import Iterator
+
+__all__ = ('FRAME_STORE', 'frame_stack', 'frame_images', 'store_fd', 'map_fd')
+
+# smaller stacks stay in the buffer pool, a mapping per request isn't worth it for them
+MIN_STORED = 4 * 1024 * 1024
+# frames kept mapped behind the one being encoded
+WINDOW = 2
+
+
+class _Mapping(mmap.mmap):
+    """Shared mapping of a frame store file, ``fd`` stays open for handing it to another process."""
+    fd: int
+
+
+def _store_from_env() -> Optional[str]:
+    # ZNEITIZ_FRAME_STORE=memfd|file, off by default. file goes to ZNEITIZ_FRAME_STORE_DIR,
+    # pages written there can be written back and dropped under memory pressure
+    backing = os.environ.get('ZNEITIZ_FRAME_STORE', '').lower()
+    if backing in ('', '0', 'off'):
+        return None
+    if backing == 'memfd' and not hasattr(os, 'memfd_create'):
+        return 'file'
+    if backing not in ('memfd', 'file'):
+        raise ValueError(f'ZNEITIZ_FRAME_STORE must be memfd, file or off, not {backing!r}')
+    return backing
+
+
+FRAME_STORE = _store_from_env()
+FRAME_STORE_DIR = os.environ.get('ZNEITIZ_FRAME_STORE_DIR') or None
+
+
+def _open(backing: str) -> int:
+    if backing == 'memfd':
+        return os.memfd_create('zneitiz-frames', os.MFD_CLOEXEC)
+    fd, path = tempfile.mkstemp(prefix='zneitiz-frames-', dir=FRAME_STORE_DIR)
+    os.unlink(path)
+    return fd
+
+
+def map_fd(fd: int, shape, dtype=np.uint8) -> np.ndarray:
+    """An array over the whole file ``fd``, which is owned by the array from now on."""
+    dtype = np.dtype(dtype)
+    nbytes = max(1, int(np.prod(shape)) * dtype.itemsize)
+    try:
+        if os.fstat(fd).st_size < nbytes:
+            # a new file reads as zeros and only takes memory where it's written
+            os.ftruncate(fd, nbytes)
+        mapping = _Mapping(fd, nbytes)
+    except BaseException:
+        os.close(fd)
+        raise
+    mapping.fd = fd
+    weakref.finalize(mapping, os.close, fd)
+    return np.ndarray(shape, dtype=dtype, buffer=mapping)
+
+
+def _mapping_of(arr: np.ndarray) -> Optional[_Mapping]:
+    base = arr.base
+    while isinstance(base, np.ndarray):
+        base = base.base
+    return base if isinstance(base, _Mapping) else None
+
+
+def store_fd(arr: np.ndarray) -> Optional[int]:
+    """The store file of ``arr`` when it is a whole frame store, as made by ``frame_stack``."""
+    mapping = _mapping_of(arr)
+    if mapping is None or not arr.flags.c_contiguous or arr.nbytes != len(mapping):
+        return None
+    return mapping.fd
+
+
+def frame_stack(shape, *, zeroed: bool = True) -> np.ndarray:
+    """A uint8 frame stack, in the frame store when enabled and the stack is big.
+    Stacks from the store are always zeroed."""
+    if FRAME_STORE is None or int(np.prod(shape)) < MIN_STORED:
+        return pool_zeros(shape) if zeroed else pool_empty(shape)
+    return map_fd(_open(FRAME_STORE), shape)
+
+
+def _release(frames: np.ndarray, start: int, stop: int) -> int:
+    """Give back the whole pages of bytes ``[start, stop)`` of a store, they read as zeros
+    afterwards. Returns where the next call should start."""
+    mapping = _mapping_of(frames)
+    stop = stop // mmap.PAGESIZE * mmap.PAGESIZE
+    if mapping is None or stop <= start:
+        return start
+    try:
+        # frees the file's memory too, not only this process' mapping of it
+        mapping.madvise(mmap.MADV_REMOVE, start, stop - start)
+    except OSError:
+        mapping.madvise(mmap.MADV_DONTNEED, start, stop - start)
+    return stop
+
+
+def frame_images(frames: np.ndarray, window: int = WINDOW) -> Iterator[Image.Image]:
+    """Images of ``frames`` one at a time, for ``append_images`` of an encoder that reads
+    them in order. Frames of a store more than ``window`` frames behind the current one
+    are released, so only the encoder's own copies of them stay around.
+    """
+    released = 0
+    for i in range(len(frames)):
+        yield Image.fromarray(frames[i])
+        if i >= window:
+            released = _release(frames, released, (i - window + 1) * frames.strides[0])
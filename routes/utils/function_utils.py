@@ -1,30 +1,52 @@
 from __future__ import annotations
-from typing import TYPE_CHECKING, TypeVar
+from typing import TYPE_CHECKING, TypeVar, Optional, Literal
 
+import time
 import asyncio
 import functools
+import contextvars
 
 from pydantic import ValidationError
 from fastapi import Form, Depends, UploadFile
 
-from ..errors.errors import ZNeitizException, UnsupportedType
+from ..errors.errors import ZNeitizException, UnsupportedType, PayloadTooLarge
+from .session import MAX_FILESIZE, IMAGE_LIMITS, ImageLimits, check_limits
+from .process_pool import get_process_pool, run_in_process
+from .metrics import span, add_span, add_bytes_in
 
 if TYPE_CHECKING:
     from typing import Callable, Awaitable
     from pydantic import BaseModel
+    from starlette.requests import Request
 
 T = TypeVar('T')
 BM = TypeVar('BM')
 
+AnimationFormat = Literal['gif', 'apng']
 
-def in_executor(executor=None):
+
+def in_executor(executor=None, *, process: bool = False):
+    """Run ``func`` in ``executor``, the default thread pool if None.
+
+    ``process=True`` marks module level functions that may run on the process pool
+    instead, when it's enabled. Their arguments and results have to be picklable.
+    """
 
     def decorator(func: Callable[..., T]) -> Callable[..., Awaitable[T]]:
 
         @functools.wraps(func)
         def wrapper(*args, **kwargs) -> Awaitable[T]:
-            partial = functools.partial(func, *args, **kwargs)
-            return asyncio.get_running_loop().run_in_executor(executor, partial)
+            if process and get_process_pool() is not None:
+                return asyncio.ensure_future(run_in_process(func, *args, **kwargs))
+            submitted = time.perf_counter()
+
+            def run() -> T:
+                add_span('executor_wait', time.perf_counter() - submitted)
+                return func(*args, **kwargs)
+
+            # carry the request's metrics context into the worker thread
+            context = contextvars.copy_context()
+            return asyncio.get_running_loop().run_in_executor(executor, context.run, run)
         wrapper.original = func  # type: ignore  # monkey
 
         return wrapper
@@ -32,11 +54,15 @@ def in_executor(executor=None):
     return decorator
 
 
-def model_checker(model: type[BaseModel]):
+def model_checker(model: type[BaseModel], *, optional: bool = False):
+    """``optional`` for endpoints that took no options before, no form field means the defaults."""
 
-    async def checker(data: str = Form(...)) -> BaseModel:
+    async def checker(data: Optional[str] = Form(None if optional else ...)) -> BaseModel:
+        if data is None:
+            return model()
         try:
-            model_data = model.model_validate(data)
+            # the form field is the options as a JSON string
+            model_data = model.model_validate_json(data)
         except ValidationError:
             raise ZNeitizException(message='Could not parse form data')
 
@@ -45,6 +71,33 @@ def model_checker(model: type[BaseModel]):
     return Depends(checker)
 
 
+def _accept_quality(accept: str, media_type: str) -> float:
+    # only an explicit entry counts, */* and image/* leave the choice to us
+    for part in accept.split(','):
+        value, *params = part.strip().split(';')
+        if value.strip().lower() != media_type:
+            continue
+        for param in params:
+            name, _, q = param.strip().partition('=')
+            if name.strip() == 'q':
+                try:
+                    return float(q)
+                except ValueError:
+                    return 0.0
+        return 1.0
+    return -1.0
+
+
+def animation_format(request: Request, requested: Optional[AnimationFormat] = None) -> AnimationFormat:
+    """Output format of an animated response, a ``format`` parameter if given, otherwise
+    apng when the Accept header prefers image/apng to image/gif. gif by default."""
+    if requested:
+        return requested
+    accept = request.headers.get('accept', '')
+    apng = _accept_quality(accept, 'image/apng')
+    return 'apng' if apng > 0 and apng > _accept_quality(accept, 'image/gif') else 'gif'
+
+
 def _get_mime_type_for_image(data: bytes):
     if data.startswith(b'\x89\x50\x4E\x47\x0D\x0A\x1A\x0A'):
         return 'image/png'
@@ -58,12 +111,18 @@ def _get_mime_type_for_image(data: bytes):
         raise UnsupportedType()
 
 
-async def get_upload_file(file: UploadFile) -> bytes:
-    try:
-        inital_bytes = await file.read(50)
-    except Exception:
-        raise UnsupportedType
-    else:
-        _get_mime_type_for_image(inital_bytes)
-
-    return inital_bytes + await file.read()
+async def get_upload_file(file: UploadFile, *, limits: Optional[ImageLimits] = None) -> bytes:
+    with span('fetch'):
+        try:
+            inital_bytes = await file.read(50)
+        except Exception:
+            raise UnsupportedType
+        else:
+            _get_mime_type_for_image(inital_bytes)
+
+        data = inital_bytes + await file.read(MAX_FILESIZE + 1 - len(inital_bytes))
+        add_bytes_in(len(data))
+        if len(data) > MAX_FILESIZE:
+            raise PayloadTooLarge('File greater than max allowed filesize (10 MB).')
+        check_limits(data, limits or IMAGE_LIMITS['default'])
+    return data
@@ -0,0 +1,115 @@
+import struct
+import itertools
+from typing import IO, Iterable, NamedTuple, Optional, Union
+
+import numpy as np
+from PIL import Image, GifImagePlugin
+
+__all__ = ('save_gif',)
+
+
+class _Frame(NamedTuple):
+    # indices into the palette of the frame
+    index: np.ndarray
+    # (n, 3) palette, the transparent entry or None
+    palette: np.ndarray
+    transparent: Optional[int]
+    # RGBA the frame shows as one uint32 a pixel, transparent pixels are 0
+    shown: np.ndarray
+
+
+def _quantize(im: Image.Image) -> _Frame:
+    """One adaptive palette per frame as Pillow's gif encoder does, with every pixel of
+    alpha 0 on the single transparent entry."""
+    if im.mode == 'RGBA':
+        rgba = np.array(im)
+        rgba[rgba[..., 3] == 0] = 0
+        p = Image.fromarray(rgba).convert('P', palette=Image.Palette.ADAPTIVE)
+        palette = np.array(p.getpalette('RGBA'), dtype=np.uint8).reshape(-1, 4)
+        empty = np.flatnonzero(palette[:, 3] == 0)
+        transparent = int(empty[0]) if len(empty) else None
+    else:
+        p = im.convert('RGB').convert('P', palette=Image.Palette.ADAPTIVE)
+        palette = np.array(p.getpalette('RGBA'), dtype=np.uint8).reshape(-1, 4)
+        transparent = None
+    index = np.asarray(p)
+    lut = palette.copy()
+    lut[:, 3] = 255
+    if transparent is not None:
+        lut[transparent] = 0
+    return _Frame(index, palette[:, :3], transparent, lut.view('<u4')[:, 0][index])
+
+
+def _bbox(mask: np.ndarray) -> tuple[int, int, int, int]:
+    rows = np.flatnonzero(mask.any(axis=1))
+    if not len(rows):
+        # nothing changes, a pixel is drawn again to keep the frame and its duration
+        return 0, 0, 1, 1
+    cols = np.flatnonzero(mask.any(axis=0))
+    return int(cols[0]), int(rows[0]), int(cols[-1]) + 1, int(rows[-1]) + 1
+
+
+def _frame_data(frame: _Frame, changed: np.ndarray, box: tuple[int, int, int, int], **params) -> list[bytes]:
+    """The ``box`` of ``frame`` with a color table of the colors in it, what didn't change is
+    left transparent when the table has room for it."""
+    left, top, right, bottom = box
+    index = frame.index[top:bottom, left:right].astype(np.intp)
+    transparent = frame.transparent
+    if transparent is None and np.count_nonzero(np.bincount(index.ravel(), minlength=256)) < 256:
+        # the entry after the used ones, only for the unchanged pixels
+        transparent = 256
+    if transparent is not None:
+        index = np.where(changed[top:bottom, left:right], index, transparent)
+    used = np.flatnonzero(np.bincount(index.ravel(), minlength=257))
+    lut = np.zeros(257, dtype=np.uint8)
+    lut[used] = np.arange(len(used))
+    palette = np.zeros((len(used), 3), dtype=np.uint8)
+    real = used[used < len(frame.palette)]
+    palette[:len(real)] = frame.palette[real]
+
+    im = Image.fromarray(lut[index], 'P')
+    im.putpalette(palette.tobytes())
+    if transparent in used:
+        params['transparency'] = int(lut[transparent])
+    return GifImagePlugin.getdata(im, (left, top), include_color_table=True, **params)
+
+
+def save_gif(
+    fp: IO[bytes],
+    frames: Iterable[Image.Image],
+    *,
+    duration: Union[int, list[int]],
+    loop: int = 0,
+):
+    """Write ``frames`` as an animated gif, each frame stored as the rectangle of what changes
+    from the one before. Pillow clears a frame, disposal 2, only as a whole and stores every
+    frame after it whole, here a frame is cleared after it's shown only when the next one
+    erases pixels of it, and only within its rectangle, which then covers them.
+    Frames are read one ahead of the one written."""
+    durations = iter(duration) if isinstance(duration, list) else itertools.repeat(duration)
+    frames = iter(frames)
+    first = _quantize(next(frames))
+    height, width = first.index.shape
+    fp.write(struct.pack('<6sHHBBB', b'GIF89a', width, height, 0, 0, 0))
+    fp.write(b'!\xff\x0bNETSCAPE2.0\x03\x01' + struct.pack('<H', loop) + b'\x00')
+
+    canvas = np.zeros((height, width), dtype=np.uint32)
+    frame: Optional[_Frame] = first
+    while frame is not None:
+        im = next(frames, None)
+        following = None if im is None else _quantize(im)
+        # the last frame gives way to the first one when it loops
+        after = first if following is None else following
+        cleared = (frame.shown != 0) & (after.shown == 0)
+        changed = frame.shown != canvas
+        box = _bbox(changed | cleared)
+        disposal = 2 if cleared.any() else 1
+        for data in _frame_data(frame, changed, box, duration=next(durations), disposal=disposal):
+            fp.write(data)
+
+        canvas = frame.shown.copy()
+        if disposal == 2:
+            left, top, right, bottom = box
+            canvas[top:bottom, left:right] = 0
+        frame = following
+    fp.write(b';')
@@ -0,0 +1,290 @@
+from __future__ import annotations
+from typing import NamedTuple, Optional
+
+__all__ = ('ImageInfo', 'PaletteTable', 'probe_header', 'count_frames', 'palette_tables')
+
+
+class ImageInfo(NamedTuple):
+    mime: str
+    width: int
+    height: int
+    # None when the frame count can't be known from the bytes seen so far
+    frames: Optional[int]
+
+
+class PaletteTable(NamedTuple):
+    # byte offset of the first RGB triplet and the number of colors
+    offset: int
+    colors: int
+    # indices that are transparent in every frame using the table
+    transparent: frozenset[int]
+    # PNG: offset of the chunk type, its CRC has to be redone after a change
+    chunk: Optional[int] = None
+
+
+def _u16be(data, i: int) -> int:
+    return (data[i] << 8) | data[i+1]
+
+
+def _u16le(data, i: int) -> int:
+    return data[i] | (data[i+1] << 8)
+
+
+def _u24le(data, i: int) -> int:
+    return data[i] | (data[i+1] << 8) | (data[i+2] << 16)
+
+
+def _u32be(data, i: int) -> int:
+    return int.from_bytes(data[i:i+4], 'big')
+
+
+def _u32le(data, i: int) -> int:
+    return int.from_bytes(data[i:i+4], 'little')
+
+
+def _probe_png(data) -> Optional[ImageInfo]:
+    # signature(8) + IHDR length(4) + type(4) + width(4) + height(4)
+    if len(data) < 24 or data[12:16] != b'IHDR':
+        return None
+    width, height = _u32be(data, 16), _u32be(data, 20)
+
+    # acTL (APNG) must come before the first IDAT
+    frames = None
+    i = 8
+    while i + 8 <= len(data):
+        length = _u32be(data, i)
+        chunk_type = bytes(data[i+4:i+8])
+        if chunk_type == b'acTL':
+            if i + 12 <= len(data):
+                frames = _u32be(data, i+8)
+            break
+        if chunk_type == b'IDAT':
+            frames = 1
+            break
+        i += length + 12
+    return ImageInfo('image/png', width, height, frames)
+
+
+def _probe_gif(data) -> Optional[ImageInfo]:
+    if len(data) < 10:
+        return None
+    return ImageInfo('image/gif', _u16le(data, 6), _u16le(data, 8), None)
+
+
+# SOFn markers, excluding DHT (C4), JPG (C8) and DAC (CC)
+_JPEG_SOF = {0xC0, 0xC1, 0xC2, 0xC3, 0xC5, 0xC6, 0xC7, 0xC9, 0xCA, 0xCB, 0xCD, 0xCE, 0xCF}
+
+
+def _probe_jpeg(data) -> Optional[ImageInfo]:
+    i = 2
+    while i + 4 <= len(data):
+        if data[i] != 0xFF:
+            # corrupt stream, let the decoder deal with it
+            return None
+        marker = data[i+1]
+        if marker == 0xFF:
+            # fill byte
+            i += 1
+            continue
+        if marker == 0x01 or 0xD0 <= marker <= 0xD9:
+            # standalone markers, no length
+            i += 2
+            continue
+        length = _u16be(data, i+2)
+        if marker in _JPEG_SOF:
+            if i + 9 > len(data):
+                return None
+            # precision(1) height(2) width(2)
+            return ImageInfo('image/jpeg', _u16be(data, i+7), _u16be(data, i+5), 1)
+        i += 2 + length
+    return None
+
+
+def _probe_webp(data) -> Optional[ImageInfo]:
+    if len(data) < 30:
+        return None
+    chunk_type = bytes(data[12:16])
+    if chunk_type == b'VP8X':
+        flags = data[20]
+        width = 1 + _u24le(data, 24)
+        height = 1 + _u24le(data, 27)
+        # animation flag, frames are counted from ANMF chunks
+        return ImageInfo('image/webp', width, height, None if flags & 0x02 else 1)
+    if chunk_type == b'VP8L':
+        if data[20] != 0x2F:
+            return None
+        bits = _u32le(data, 21)
+        return ImageInfo('image/webp', 1 + (bits & 0x3FFF), 1 + ((bits >> 14) & 0x3FFF), 1)
+    if chunk_type == b'VP8 ':
+        # frame tag(3) + start code(3) + 14 bit width/height
+        if data[23:26] != b'\x9d\x01\x2a':
+            return None
+        return ImageInfo('image/webp', _u16le(data, 26) & 0x3FFF, _u16le(data, 28) & 0x3FFF, 1)
+    return None
+
+
+def probe_header(data) -> Optional[ImageInfo]:
+    """Read the dimensions out of a PNG/GIF/JPEG/WebP header without decoding.
+
+    Returns None if the format is unknown or not enough of the file is available yet.
+    """
+    if data[:8] == b'\x89PNG\r\n\x1a\n':
+        return _probe_png(data)
+    if data[:6] in (b'GIF87a', b'GIF89a'):
+        return _probe_gif(data)
+    if data[:3] == b'\xff\xd8\xff':
+        return _probe_jpeg(data)
+    if data[:4] == b'RIFF' and data[8:12] == b'WEBP':
+        return _probe_webp(data)
+    return None
+
+
+def _skip_sub_blocks(data, i: int) -> int:
+    while i < len(data):
+        size = data[i]
+        i += 1 + size
+        if size == 0:
+            break
+    return i
+
+
+def _count_gif_frames(data) -> int:
+    if len(data) < 13:
+        return 0
+    i = 13
+    flags = data[10]
+    if flags & 0x80:
+        i += 3 * (2 << (flags & 0x07))
+
+    frames = 0
+    while i < len(data):
+        block = data[i]
+        if block == 0x2C:
+            # image descriptor, skip local color table, LZW code size and the image data
+            frames += 1
+            if i + 10 > len(data):
+                break
+            flags = data[i+9]
+            i += 10
+            if flags & 0x80:
+                i += 3 * (2 << (flags & 0x07))
+            i = _skip_sub_blocks(data, i + 1)
+        elif block == 0x21:
+            i = _skip_sub_blocks(data, i + 2)
+        else:
+            # trailer or garbage
+            break
+    return frames
+
+
+def _count_webp_frames(data) -> int:
+    frames = 0
+    i = 12
+    while i + 8 <= len(data):
+        chunk_type = bytes(data[i:i+4])
+        size = _u32le(data, i+4)
+        if chunk_type == b'ANMF':
+            frames += 1
+        # chunks are padded to even sizes
+        i += 8 + size + (size & 1)
+    return frames
+
+
+def count_frames(data, info: ImageInfo) -> int:
+    """Count the frames of a fully downloaded image by walking its blocks, without decoding."""
+    if info.frames is not None:
+        return info.frames
+    if info.mime == 'image/png':
+        full = _probe_png(data)
+        return (full and full.frames) or 1
+    if info.mime == 'image/gif':
+        return max(1, _count_gif_frames(data))
+    if info.mime == 'image/webp':
+        return max(1, _count_webp_frames(data))
+    return 1
+
+
+def _gif_palettes(data) -> Optional[list[PaletteTable]]:
+    if len(data) < 13:
+        return None
+    # offset -> [colors, transparent index of each frame using it, None for none]
+    tables: dict[int, list] = {}
+    global_table = None
+    i = 13
+    flags = data[10]
+    if flags & 0x80:
+        global_table = i
+        tables[i] = [2 << (flags & 0x07), set()]
+        i += 3 * tables[i][0]
+
+    transparent = None
+    while i < len(data):
+        block = data[i]
+        if block == 0x2C:
+            if i + 10 > len(data):
+                return None
+            flags = data[i+9]
+            i += 10
+            table = global_table
+            if flags & 0x80:
+                table = i
+                tables[i] = [2 << (flags & 0x07), set()]
+                i += 3 * tables[i][0]
+            if table is None:
+                # no color table at all, nothing to recolor
+                return None
+            tables[table][1].add(transparent)
+            transparent = None
+            i = _skip_sub_blocks(data, i + 1)
+        elif block == 0x21:
+            if i + 7 <= len(data) and data[i+1] == 0xF9 and data[i+2] == 4 and data[i+3] & 0x01:
+                # graphic control extension of the next image, with a transparent index
+                transparent = data[i+6]
+            i = _skip_sub_blocks(data, i + 2)
+        elif block == 0x3B:
+            break
+        else:
+            return None
+    if i > len(data) or any(offset + 3 * colors > len(data) for offset, (colors, _) in tables.items()):
+        return None
+    if any(len(t) > 1 for _, t in tables.values()):
+        # an index transparent in one frame and shown in another can't be left out of the
+        # table, nor be recolored as if it was seen everywhere
+        return None
+    return [PaletteTable(offset, colors, frozenset(t) - {None}) for offset, (colors, t) in tables.items()]
+
+
+def _png_palettes(data) -> Optional[list[PaletteTable]]:
+    # color type 3 is indexed
+    if len(data) < 26 or data[25] != 3:
+        return None
+    palette = None
+    transparent: frozenset[int] = frozenset()
+    i = 8
+    while i + 8 <= len(data):
+        length = _u32be(data, i)
+        chunk_type = bytes(data[i+4:i+8])
+        if i + 12 + length > len(data):
+            return None
+        if chunk_type == b'PLTE':
+            palette = i
+        elif chunk_type == b'tRNS':
+            transparent = frozenset(index for index, alpha in enumerate(data[i+8:i+8+length]) if alpha == 0)
+        elif chunk_type == b'IEND':
+            break
+        i += length + 12
+    if palette is None or _u32be(data, palette) % 3:
+        return None
+    return [PaletteTable(palette + 8, _u32be(data, palette) // 3, transparent, palette + 4)]
+
+
+def palette_tables(data) -> Optional[list[PaletteTable]]:
+    """Every color table of an indexed GIF or PNG, found by walking its blocks.
+
+    None for anything else and for files that end early or have unknown blocks.
+    """
+    if data[:6] in (b'GIF87a', b'GIF89a'):
+        return _gif_palettes(data)
+    if data[:8] == b'\x89PNG\r\n\x1a\n':
+        return _png_palettes(data)
+    return None
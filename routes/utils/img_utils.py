@@ -1,8 +1,11 @@
 from __future__ import annotations
-from typing import TYPE_CHECKING, Literal
+from typing import Literal, Optional, Iterator
+
+import numpy as np
+from PIL import Image, ImageSequence
+
+from .metrics import add_info
 
-if TYPE_CHECKING:
-    from PIL import Image
 
 def _limit_size(
     im: Image.Image,
@@ -23,3 +26,101 @@ def _limit_size(
             resample=downscale_sample if ratio < 1 else upscale_sample
         )
     return im
+
+
+def fit_size(
+    size: tuple[int, int],
+    *,
+    width: Optional[int] = None,
+    max_size: Optional[int] = None,
+) -> tuple[int, int]:
+    """Size after scaling to ``width`` and then limiting the longest side to ``max_size``,
+    same math as ``resize`` + ``_limit_size``."""
+    w, h = size
+    if width and w != width:
+        w, h = width, max(1, int(h * width/w))
+    if max_size:
+        longest = max(w, h)
+        if longest > max_size:
+            ratio = max_size/longest
+            w, h = max(1, int(w*ratio)), max(1, int(h*ratio))
+    return w, h
+
+
+def decode_reduced(
+    im: Image.Image,
+    size: tuple[int, int],
+    *,
+    reducing_gap: float = 2.0,
+    resample: Optional[Image.Resampling] = None,
+) -> Image.Image:
+    """Decode ``im`` straight at ``size``.
+
+    JPEGs are decoded with DCT scaling (1/2, 1/4, 1/8) through draft mode, everything
+    else gets a cheap integer box reduce before the final resample, ``resample`` or
+    Pillow's default for the mode. Must be called before the image is loaded for draft to apply.
+    """
+    add_info(source_size=list(im.size), size=list(size))
+    if im.size == size:
+        return im
+    if im.format == 'JPEG':
+        ratio = reducing_gap if size[0] < im.width else 1
+        im.draft(None, (int(size[0] * ratio), int(size[1] * ratio)))  # type: ignore  # draft is on ImageFile
+        if im.size == size:
+            return im
+    return im.resize(size, resample, reducing_gap=reducing_gap)
+
+
+def decode_rgba(
+    im: Image.Image,
+    size: Optional[tuple[int, int]] = None,
+    *,
+    pad: tuple[int, int, int, int] = (0, 0, 0, 0),
+    resample: Optional[Image.Resampling] = None,
+) -> np.ndarray:
+    """Decode ``im`` at ``size`` into a writeable RGBA array, ``resample`` as in ``decode_reduced``.
+
+    ``pad`` is (top, right, bottom, left) transparent padding, allocated together with
+    the image instead of stacking zero arrays around it afterwards.
+    """
+    if size:
+        im = decode_reduced(im, size, resample=resample)
+    if im.mode != 'RGBA':
+        im = im.convert('RGBA')
+    return pad_rgba(np.asarray(im), pad)
+
+
+def pad_rgba(rgba: np.ndarray, pad: tuple[int, int, int, int] = (0, 0, 0, 0)) -> np.ndarray:
+    """A new writeable copy of the (h, w, 4) array ``rgba`` with ``pad`` of ``decode_rgba``."""
+    top, right, bottom, left = pad
+    h, w = rgba.shape[:2]
+    arr = np.zeros([top + h + bottom, left + w + right, 4], dtype=np.uint8)
+    arr[top:top+h, left:left+w] = rgba
+    add_info(canvas=[arr.shape[1], arr.shape[0]])
+    return arr
+
+
+def iter_frames(im: Image.Image, *, max_frames: Optional[int] = None) -> Iterator[tuple[Image.Image, int]]:
+    """Yield (frame, duration) for every frame of ``im``.
+
+    Animations longer than ``max_frames`` are subsampled, every n-th frame is kept with
+    the durations of the dropped frames after it added to its own.
+    """
+    n_frames = getattr(im, 'n_frames', 1)
+    if not max_frames or n_frames <= max_frames:
+        for frame in ImageSequence.Iterator(im):
+            yield frame, frame.info.get('duration', 40)
+        return
+
+    step = -(-n_frames // max_frames)
+    kept = None
+    duration = 0
+    for index, frame in enumerate(ImageSequence.Iterator(im)):
+        if index % step == 0:
+            if kept is not None:
+                yield kept, duration
+            kept = frame.copy()
+            duration = 0
+        duration += frame.info.get('duration', 40)
+    if kept is not None:
+        yield kept, duration
@@ -0,0 +1,341 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, Any, Optional
+
+import hmac
+import time
+import bisect
+from urllib.parse import parse_qs
+from contextvars import ContextVar
+from contextlib import contextmanager
+
+import orjson
+
+if TYPE_CHECKING:
+    from typing import Iterator
+
+__all__ = (
+    'Histogram',
+    'Metrics',
+    'RequestTimer',
+    'MetricsMiddleware',
+    'METRICS',
+    'span',
+    'add_span',
+    'add_bytes_in',
+    'add_info',
+    'add_counters',
+    'set_endpoint',
+    'current_timer',
+    'use_timer',
+)
+
+# upper bounds in seconds, the last bucket catches everything else
+BUCKETS = (
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, float('inf'),
+)
+
+QUANTILES = (0.5, 0.9, 0.99)
+
+
+class Histogram:
+    __slots__ = ('counts', 'sum', 'count')
+
+    def __init__(self):
+        self.counts = [0] * len(BUCKETS)
+        self.sum = 0.0
+        self.count = 0
+
+    def observe(self, value: float):
+        self.counts[bisect.bisect_left(BUCKETS, value)] += 1
+        self.sum += value
+        self.count += 1
+
+    def quantile(self, q: float) -> float:
+        """Estimate from the buckets, interpolating linearly inside the bucket."""
+        if not self.count:
+            return 0.0
+        rank = q * self.count
+        seen = 0
+        for i, count in enumerate(self.counts):
+            if seen + count >= rank and count:
+                lower = BUCKETS[i-1] if i else 0.0
+                upper = BUCKETS[i]
+                if upper == float('inf'):
+                    return lower
+                return lower + (upper - lower) * (rank - seen) / count
+            seen += count
+        return BUCKETS[-2]
+
+
+class Metrics:
+    """Process wide request metrics, only formatted when scraped."""
+
+    def __init__(self):
+        # (endpoint, stage) -> seconds spent in that stage per request
+        self.latency: dict[tuple[str, str], Histogram] = {}
+        # (endpoint, status) -> requests
+        self.requests: dict[tuple[str, int], int] = {}
+        self.bytes_in: dict[str, int] = {}
+        self.bytes_out: dict[str, int] = {}
+        # (endpoint, counter) -> total native kernel work
+        self.counters: dict[tuple[str, str], float] = {}
+        # constant labels of zneitiz_build_info, like the ISA the kernels picked
+        self.build_info: dict[str, str] = {}
+
+    def observe(self, endpoint: str, stage: str, seconds: float):
+        key = endpoint, stage
+        hist = self.latency.get(key)
+        if hist is None:
+            hist = self.latency[key] = Histogram()
+        hist.observe(seconds)
+
+    def finish(self, timer: RequestTimer, status: int):
+        endpoint = timer.endpoint
+        if endpoint is None:
+            return
+        for stage, seconds in timer.stages.items():
+            self.observe(endpoint, stage, seconds)
+        self.observe(endpoint, 'total', time.perf_counter() - timer.start)
+        key = endpoint, status
+        self.requests[key] = self.requests.get(key, 0) + 1
+        self.bytes_in[endpoint] = self.bytes_in.get(endpoint, 0) + timer.bytes_in
+        self.bytes_out[endpoint] = self.bytes_out.get(endpoint, 0) + timer.bytes_out
+        for name, value in timer.counters.items():
+            key = endpoint, name
+            self.counters[key] = self.counters.get(key, 0) + value
+
+    def render(self) -> str:
+        """Prometheus text exposition format."""
+        lines = [
+            '# HELP zneitiz_stage_seconds Time spent per request in each stage.',
+            '# TYPE zneitiz_stage_seconds histogram',
+        ]
+        for (endpoint, stage), hist in sorted(self.latency.items()):
+            labels = f'endpoint="{endpoint}",stage="{stage}"'
+            cumulative = 0
+            for bound, count in zip(BUCKETS, hist.counts):
+                cumulative += count
+                le = '+Inf' if bound == float('inf') else repr(bound)
+                lines.append(f'zneitiz_stage_seconds_bucket{{{labels},le="{le}"}} {cumulative}')
+            lines.append(f'zneitiz_stage_seconds_sum{{{labels}}} {hist.sum!r}')
+            lines.append(f'zneitiz_stage_seconds_count{{{labels}}} {hist.count}')
+
+        lines.append('# HELP zneitiz_stage_seconds_quantile Bucket estimated stage time quantiles.')
+        lines.append('# TYPE zneitiz_stage_seconds_quantile gauge')
+        for (endpoint, stage), hist in sorted(self.latency.items()):
+            for q in QUANTILES:
+                lines.append(
+                    f'zneitiz_stage_seconds_quantile{{endpoint="{endpoint}",stage="{stage}",quantile="{q}"}} '
+                    f'{hist.quantile(q)!r}'
+                )
+
+        lines.append('# HELP zneitiz_requests_total Finished requests.')
+        lines.append('# TYPE zneitiz_requests_total counter')
+        for (endpoint, status), count in sorted(self.requests.items()):
+            lines.append(f'zneitiz_requests_total{{endpoint="{endpoint}",status="{status}"}} {count}')
+
+        for name, values, help_text in (
+            ('zneitiz_bytes_in_total', self.bytes_in, 'Image bytes downloaded or uploaded.'),
+            ('zneitiz_bytes_out_total', self.bytes_out, 'Response body bytes sent.'),
+        ):
+            lines.append(f'# HELP {name} {help_text}')
+            lines.append(f'# TYPE {name} counter')
+            for endpoint, count in sorted(values.items()):
+                lines.append(f'{name}{{endpoint="{endpoint}"}} {count}')
+
+        lines.append('# HELP zneitiz_kernel_work_total Work counted by the native kernels.')
+        lines.append('# TYPE zneitiz_kernel_work_total counter')
+        for (endpoint, counter), value in sorted(self.counters.items()):
+            lines.append(f'zneitiz_kernel_work_total{{endpoint="{endpoint}",counter="{counter}"}} {value!r}')
+
+        if self.build_info:
+            lines.append('# HELP zneitiz_build_info Build and runtime dispatch of this process.')
+            lines.append('# TYPE zneitiz_build_info gauge')
+            labels = ','.join(f'{name}="{value}"' for name, value in sorted(self.build_info.items()))
+            lines.append(f'zneitiz_build_info{{{labels}}} 1')
+
+        lines.append('')
+        return '\n'.join(lines)
+
+
+METRICS = Metrics()
+
+
+class RequestTimer:
+    __slots__ = ('endpoint', 'start', 'stages', 'info', 'counters', 'bytes_in', 'bytes_out')
+
+    def __init__(self, endpoint: Optional[str] = None):
+        self.endpoint = endpoint
+        self.start = time.perf_counter()
+        # stage -> seconds, a stage entered more than once (per frame) adds up
+        self.stages: dict[str, float] = {}
+        # geometry and work counts, only shown in traces
+        self.info: dict[str, Any] = {}
+        # native kernel counters, summed over every kernel call of the request
+        self.counters: dict[str, float] = {}
+        self.bytes_in = 0
+        self.bytes_out = 0
+
+    def add(self, stage: str, seconds: float):
+        self.stages[stage] = self.stages.get(stage, 0.0) + seconds
+
+    def merge(self, other: RequestTimer):
+        """Fold in what was recorded for this request somewhere else, like a worker process."""
+        for stage, seconds in other.stages.items():
+            self.add(stage, seconds)
+        self.info.update(other.info)
+        for name, value in other.counters.items():
+            self.counters[name] = self.counters.get(name, 0) + value
+
+    def server_timing(self) -> str:
+        stages = [f'{stage};dur={seconds * 1000:.2f}' for stage, seconds in self.stages.items()]
+        stages.append(f'total;dur={(time.perf_counter() - self.start) * 1000:.2f}')
+        return ', '.join(stages)
+
+    def trace(self, status: int, media_type: Optional[str]) -> dict[str, Any]:
+        return {
+            'endpoint': self.endpoint,
+            'status': status,
+            'media_type': media_type,
+            'total_ms': (time.perf_counter() - self.start) * 1000,
+            'stages_ms': {stage: seconds * 1000 for stage, seconds in self.stages.items()},
+            'bytes_in': self.bytes_in,
+            'bytes_out': self.bytes_out,
+            'counters': self.counters,
+            **self.info,
+        }
+
+
+_timer: ContextVar[Optional[RequestTimer]] = ContextVar('zneitiz_timer', default=None)
+
+
+def current_timer() -> Optional[RequestTimer]:
+    return _timer.get()
+
+
+@contextmanager
+def use_timer(timer: RequestTimer) -> Iterator[RequestTimer]:
+    token = _timer.set(timer)
+    try:
+        yield timer
+    finally:
+        _timer.reset(token)
+
+
+@contextmanager
+def span(stage: str) -> Iterator[None]:
+    """Time the block into ``stage`` of the current request, does nothing outside one."""
+    timer = _timer.get()
+    if timer is None:
+        yield
+        return
+    start = time.perf_counter()
+    try:
+        yield
+    finally:
+        timer.add(stage, time.perf_counter() - start)
+
+
+def add_span(stage: str, seconds: float):
+    timer = _timer.get()
+    if timer is not None:
+        timer.add(stage, seconds)
+
+
+def add_bytes_in(size: int):
+    timer = _timer.get()
+    if timer is not None:
+        timer.bytes_in += size
+
+
+def add_info(**values: Any):
+    timer = _timer.get()
+    if timer is not None:
+        timer.info.update(values)
+
+
+def add_counters(counters: dict[str, float]):
+    timer = _timer.get()
+    if timer is not None:
+        for name, value in counters.items():
+            timer.counters[name] = timer.counters.get(name, 0) + value
+
+
+def set_endpoint(endpoint: str):
+    timer = _timer.get()
+    if timer is not None:
+        timer.endpoint = endpoint
+
+
+class MetricsMiddleware:
+    """Gives every http request a RequestTimer, requests that never name their endpoint
+    with ``set_endpoint`` aren't recorded.
+
+    Image responses get a Server-Timing header. With ``?trace=1`` and the trace token in
+    the X-Trace-Token header, the response body is replaced by a JSON trace of the request.
+    Tracing is off when no token is configured.
+    """
+
+    def __init__(self, app, metrics: Metrics = METRICS, *, trace_token: Optional[str] = None):
+        self.app = app
+        self.metrics = metrics
+        self.trace_token = trace_token.encode() if trace_token else None
+
+    def _wants_trace(self, scope) -> bool:
+        if self.trace_token is None or b'trace=' not in scope.get('query_string', b''):
+            return False
+        if parse_qs(scope['query_string'].decode('latin-1')).get('trace') != ['1']:
+            return False
+        token = dict(scope['headers']).get(b'x-trace-token', b'')
+        return hmac.compare_digest(token, self.trace_token)
+
+    async def __call__(self, scope, receive, send):
+        if scope['type'] != 'http':
+            return await self.app(scope, receive, send)
+
+        timer = RequestTimer()
+        trace = self._wants_trace(scope)
+        status = 500
+        start_message = None
+
+        async def send_wrapper(message):
+            nonlocal status, start_message
+            if message['type'] == 'http.response.start':
+                status = message['status']
+                if timer.endpoint is not None:
+                    # the body is already rendered by now, every stage is done
+                    headers = list(message.get('headers', []))
+                    headers.append((b'server-timing', timer.server_timing().encode()))
+                    message = {**message, 'headers': headers}
+                if trace:
+                    start_message = message
+                    return
+            elif message['type'] == 'http.response.body':
+                timer.bytes_out += len(message.get('body', b''))
+                if trace:
+                    if not message.get('more_body', False):
+                        await self._send_trace(send, timer, status, start_message)
+                    return
+            await send(message)
+
+        try:
+            with use_timer(timer):
+                await self.app(scope, receive, send_wrapper)
+        finally:
+            self.metrics.finish(timer, status)
+
+    @staticmethod
+    async def _send_trace(send, timer: RequestTimer, status: int, start_message):
+        headers = dict(start_message.get('headers', [])) if start_message else {}
+        media_type = headers.get(b'content-type', b'').decode('latin-1') or None
+        body = orjson.dumps(timer.trace(status, media_type))
+
+        response_headers = [
+            (b'content-type', b'application/json'),
+            (b'content-length', str(len(body)).encode()),
+        ]
+        if b'server-timing' in headers:
+            response_headers.append((b'server-timing', headers[b'server-timing']))
+        await send({'type': 'http.response.start', 'status': 200, 'headers': response_headers})
+        await send({'type': 'http.response.body', 'body': body})
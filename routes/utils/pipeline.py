@@ -0,0 +1,96 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, Any, Callable, Iterable
+
+import queue
+import threading
+import contextvars
+
+if TYPE_CHECKING:
+    from typing import Iterator
+
+__all__ = ('pipeline',)
+
+# items in flight between two stages
+DEPTH = 2
+# how often a blocked stage looks whether the pipeline was closed
+POLL = 0.1
+
+
+class _Failed:
+    __slots__ = ('error',)
+
+    def __init__(self, error: BaseException):
+        self.error = error
+
+
+_DONE = object()
+
+
+def pipeline(source: Iterable, *stages: Callable[[Iterable], Iterable], depth: int = DEPTH) -> Iterator[Any]:
+    """Run ``source`` and every stage on a thread of its own, connected by queues of
+    ``depth`` items, and yield what the last stage yields. A stage gets the items of the one
+    before it as an iterable and yields its own, so items keep their order and a stage can
+    keep state from one item to the next.
+
+    The native work of a stage (decoders, resampling, cffi calls) runs without the GIL, so
+    the stages overlap and at most a few items per stage are alive at once. An exception in
+    any stage is raised here, closing the generator stops every stage.
+    """
+    stop = threading.Event()
+
+    def put(q: queue.Queue, item) -> bool:
+        while not stop.is_set():
+            try:
+                q.put(item, timeout=POLL)
+                return True
+            except queue.Full:
+                pass
+        return False
+
+    def drain(q: queue.Queue) -> Iterator[Any]:
+        while True:
+            try:
+                item = q.get(timeout=POLL)
+            except queue.Empty:
+                if stop.is_set():
+                    return
+                continue
+            if item is _DONE:
+                return
+            if isinstance(item, _Failed):
+                raise item.error
+            yield item
+
+    def feed(items: Iterable, q: queue.Queue):
+        try:
+            for item in items:
+                if not put(q, item):
+                    return
+            put(q, _DONE)
+        except BaseException as e:
+            # the stage after this one raises it again, up to the caller
+            put(q, _Failed(e))
+
+    threads = []
+    items = source
+    for stage in (None, *stages):
+        if stage is not None:
+            items = stage(drain(q))
+        q = queue.Queue(depth)
+        # spans and counters of every stage go to the request that runs the pipeline
+        context = contextvars.copy_context()
+        thread = threading.Thread(target=context.run, args=(feed, items, q), daemon=True)
+        threads.append(thread)
+    last = q
+
+    def run() -> Iterator[Any]:
+        for thread in threads:
+            thread.start()
+        try:
+            yield from drain(last)
+        finally:
+            stop.set()
+            for thread in threads:
+                thread.join()
+
+    return run()
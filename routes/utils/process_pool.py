@@ -0,0 +1,225 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, Any, NamedTuple, Optional
+
+import io
+import os
+import time
+import asyncio
+import weakref
+import importlib
+import multiprocessing
+from concurrent.futures import ProcessPoolExecutor
+from multiprocessing import shared_memory, resource_tracker
+from multiprocessing.reduction import DupFd
+
+import numpy as np
+from PIL import Image
+
+from .metrics import RequestTimer, current_timer, use_timer
+from .frame_store import store_fd, map_fd
+
+if TYPE_CHECKING:
+    from typing import Callable
+
+__all__ = ('start_process_pool', 'stop_process_pool', 'get_process_pool', 'run_in_process')
+
+# modules imported by every worker before it takes jobs, so the first request doesn't pay for it
+WARM_MODULES = (
+    'routes.src.salt.py_cffi_salt',
+    'routes.src.colors.py_cffi_colors',
+    'routes.src.runescape._runescape',
+    'routes.salt',
+)
+
+_pool: Optional[ProcessPoolExecutor] = None
+
+
+class _SharedArray(NamedTuple):
+    """Picklable handle of a numpy array that lives in a shared memory block."""
+    name: str
+    shape: tuple[int, ...]
+    dtype: str
+
+
+class _StoredArray(NamedTuple):
+    """An array in a frame store, the store file is handed over instead of copying it."""
+    fd: Any  # DupFd, detached by the receiver
+    shape: tuple[int, ...]
+    dtype: str
+
+
+class _EncodedImage(NamedTuple):
+    """An image opened from memory is sent as its encoded bytes and reopened in the
+    worker, pickling the Image itself would only keep the current frame."""
+    data: bytes
+
+
+def _to_shared(arr: np.ndarray) -> tuple[_SharedArray, shared_memory.SharedMemory]:
+    shm = shared_memory.SharedMemory(create=True, size=max(1, arr.nbytes))
+    np.ndarray(arr.shape, dtype=arr.dtype, buffer=shm.buf)[...] = arr
+    return _SharedArray(shm.name, arr.shape, arr.dtype.str), shm
+
+
+def _attach(handle: _SharedArray) -> np.ndarray:
+    """Map a block created by the other side. The name is removed right away, the
+    memory itself is freed once the returned array is garbage collected."""
+    shm = shared_memory.SharedMemory(name=handle.name)
+    shm.unlink()
+    arr = np.ndarray(handle.shape, dtype=np.dtype(handle.dtype), buffer=shm.buf)
+    weakref.finalize(arr, shm.close)
+    return arr
+
+
+def _receive(result: Any) -> Any:
+    """Parent side of a worker's result, arrays are mapped from where the worker left them."""
+    if isinstance(result, _SharedArray):
+        return _attach(result)
+    if isinstance(result, _StoredArray):
+        return map_fd(result.fd.detach(), result.shape, result.dtype)
+    return result
+
+
+def _warm_worker():
+    from plugins import FPngPlugin, APngPlugin
+    FPngPlugin.plug()
+    APngPlugin.plug()
+    for module in WARM_MODULES:
+        mod = importlib.import_module(module)
+        warm = getattr(mod, 'warm', None)
+        if warm:
+            warm()
+
+
+def _noop():
+    return os.getpid()
+
+
+def _call_in_process(module: str, name: str, args: tuple, kwargs: dict, submitted: float) -> tuple[Any, RequestTimer]:
+    """Worker side of ``run_in_process``, returns the result and what was recorded in here."""
+    timer = RequestTimer()
+    timer.add('executor_wait', time.monotonic() - submitted)
+    with use_timer(timer):
+        return _call(module, name, args, kwargs), timer
+
+
+def _call(module: str, name: str, args: tuple, kwargs: dict) -> Any:
+    blocks = []
+    images = []
+
+    def load(value):
+        if isinstance(value, _SharedArray):
+            shm = shared_memory.SharedMemory(name=value.name)
+            blocks.append(shm)
+            return np.ndarray(value.shape, dtype=np.dtype(value.dtype), buffer=shm.buf)
+        if isinstance(value, _EncodedImage):
+            im = Image.open(io.BytesIO(value.data))
+            images.append(im)
+            return im
+        return value
+
+    func = getattr(importlib.import_module(module), name)
+    func = getattr(func, 'original', func)
+    try:
+        result = func(*(load(a) for a in args), **{k: load(v) for k, v in kwargs.items()})
+    finally:
+        for im in images:
+            im.close()
+        for shm in blocks:
+            shm.close()
+
+    if isinstance(result, np.ndarray):
+        fd = store_fd(result)
+        if fd is not None:
+            return _StoredArray(DupFd(fd), result.shape, result.dtype.str)
+        handle, shm = _to_shared(result)
+        del result
+        # ownership moves to the parent, which unlinks it
+        resource_tracker.unregister(shm._name, 'shared_memory')  # type: ignore  # private but stable
+        shm.close()
+        return handle
+    return result
+
+
+def start_process_pool(workers: Optional[int] = None) -> ProcessPoolExecutor:
+    """Start the worker processes and wait until every one of them is warmed up."""
+    global _pool
+    if _pool is None:
+        workers = workers or os.cpu_count() or 1
+        context = multiprocessing.get_context('forkserver')
+        _pool = ProcessPoolExecutor(workers, mp_context=context, initializer=_warm_worker)
+        for future in [_pool.submit(_noop) for _ in range(workers)]:
+            future.result()
+    return _pool
+
+
+def stop_process_pool():
+    global _pool
+    if _pool is not None:
+        _pool.shutdown(wait=True, cancel_futures=True)
+    _pool = None
+
+
+def get_process_pool() -> Optional[ProcessPoolExecutor]:
+    return _pool
+
+
+async def run_in_process(func: Callable, *args, **kwargs) -> Any:
+    """Run a module level ``in_executor`` function on the process pool.
+
+    numpy arrays in the arguments and an array result are passed through shared memory
+    instead of being pickled, a result in a frame store by passing its file. Images opened
+    from memory are sent encoded, everything else is pickled as usual.
+    """
+    pool = _pool
+    assert pool is not None
+    blocks = []
+
+    def share(value):
+        if isinstance(value, np.ndarray):
+            handle, shm = _to_shared(value)
+            blocks.append(shm)
+            return handle
+        if isinstance(value, Image.Image) and isinstance(getattr(value, 'fp', None), io.BytesIO):
+            return _EncodedImage(value.fp.getvalue())
+        return value
+
+    def release():
+        for shm in blocks:
+            shm.close()
+            shm.unlink()
+
+    def settle(done):
+        # runs when the job ends even if the request awaiting it was cancelled, the result
+        # block is taken over before the inputs go, a queued job still needs its inputs
+        try:
+            if not done.cancelled() and done.exception() is None:
+                received.append((_receive(done.result()[0]), None))
+        except Exception as e:
+            received.append((None, e))
+        finally:
+            release()
+
+    received: list[tuple[Any, Optional[Exception]]] = []
+    try:
+        future = pool.submit(
+            _call_in_process,
+            func.__module__,
+            func.__qualname__,
+            tuple(share(a) for a in args),
+            {k: share(v) for k, v in kwargs.items()},
+            time.monotonic(),
+        )
+    except BaseException:
+        release()
+        raise
+    future.add_done_callback(settle)
+    # cancelling the wrapper cancels the job too when it hasn't started yet
+    _, worker_timer = await asyncio.wrap_future(future)
+
+    timer = current_timer()
+    if timer is not None:
+        timer.merge(worker_timer)
+    result, error = received[0]
+    if error is not None:
+        raise error
+    return result
@@ -0,0 +1,255 @@
+from __future__ import annotations
+from typing import TYPE_CHECKING, NamedTuple, Optional
+
+import os
+import math
+import time
+import heapq
+import asyncio
+import itertools
+from contextlib import asynccontextmanager
+
+from ..errors.errors import ServiceUnavailable
+from .img_header import probe_header, count_frames
+from .img_utils import fit_size
+from .metrics import span, set_endpoint
+
+if TYPE_CHECKING:
+    from typing import AsyncIterator
+    from starlette.requests import Request
+
+__all__ = ('Scheduler', 'QueueLimits', 'get_scheduler', 'admit', 'client_host', 'image_cost', 'text_cost')
+
+
+class QueueLimits(NamedTuple):
+    # jobs of this endpoint running at once
+    concurrency: int = 2
+    # jobs of this endpoint waiting, anything past this is turned away
+    queue_depth: int = 16
+
+
+ENDPOINT_LIMITS: dict[str, QueueLimits] = {
+    'default': QueueLimits(),
+    'particles': QueueLimits(2, 16),
+    'explode': QueueLimits(2, 16),
+    'dust': QueueLimits(2, 16),
+    'sand': QueueLimits(2, 16),
+    'replace_colors': QueueLimits(2, 16),
+    'merge_colors': QueueLimits(2, 16),
+    'runescape': QueueLimits(4, 64),
+    # only the shared decode, every effect of a batch is admitted on its own endpoint
+    'batch': QueueLimits(2, 16),
+}
+
+# relative work per (resized) pixel per input frame, output frames are folded in
+EFFECT_WEIGHTS: dict[str, float] = {
+    'particles': 120.0,
+    'explode': 110.0,
+    'dust': 115.0,
+    'sand': 150.0,
+    'replace_colors': 8.0,
+    'merge_colors': 10.0,
+    # per character
+    'runescape': 50_000.0,
+    'batch': 4.0,
+}
+
+# seconds a request may be expected to wait before it's turned away with 503
+MAX_WAIT = 10.0
+
+# starting guess of cost units per second per running job, refined from finished jobs
+INITIAL_RATE = 5_000_000.0
+
+
+def image_cost(
+    endpoint: str,
+    data: bytes,
+    *,
+    width: Optional[int] = None,
+    max_size: Optional[int] = None,
+    animated: bool = True,
+) -> float:
+    """Estimated cost of running ``endpoint`` on the image in ``data``, from its header only."""
+    info = probe_header(data)
+    if info is None:
+        w, h, frames = 128, 128, 1
+    else:
+        w, h = fit_size((info.width, info.height), width=width, max_size=max_size)
+        frames = count_frames(data, info) if animated else 1
+    return w * h * frames * EFFECT_WEIGHTS.get(endpoint, 1.0)
+
+
+def text_cost(endpoint: str, text: str) -> float:
+    return max(1, len(text)) * EFFECT_WEIGHTS.get(endpoint, 1.0)
+
+
+class _Entry:
+    __slots__ = ('tag', 'seq', 'cost', 'future')
+
+    def __init__(self, tag: float, seq: int, cost: float, future: asyncio.Future):
+        self.tag = tag
+        self.seq = seq
+        self.cost = cost
+        self.future: Optional[asyncio.Future] = future
+
+    def __lt__(self, other: _Entry) -> bool:
+        return (self.tag, self.seq) < (other.tag, other.seq)
+
+
+class _Queue:
+    def __init__(self, limits: QueueLimits):
+        self.limits = limits
+        self.running = 0
+        self.running_cost = 0.0
+        self.queued_cost = 0.0
+        self.waiting = 0
+        self.heap: list[_Entry] = []
+        # start-time fair queueing: per-client finish tags and the tag of the last dispatched job
+        self.virtual_time = 0.0
+        self.client_tags: dict[str, float] = {}
+
+    def head(self) -> Optional[_Entry]:
+        # drop entries whose waiter went away
+        while self.heap and self.heap[0].future is None:
+            heapq.heappop(self.heap)
+        return self.heap[0] if self.heap else None
+
+    def can_run(self) -> bool:
+        return self.running < self.limits.concurrency
+
+
+class Scheduler:
+    """Admission control for the compute endpoints.
+
+    Every job states its estimated cost up front. Each endpoint has its own concurrency
+    and queue depth limits, waiting jobs are ordered per endpoint with weighted fair
+    queueing over clients so one client's burst can't starve everyone else, and jobs that
+    would wait longer than ``max_wait`` are rejected with 503 and Retry-After.
+    """
+
+    def __init__(
+        self,
+        *,
+        limits: Optional[dict[str, QueueLimits]] = None,
+        max_concurrency: Optional[int] = None,
+        max_wait: float = MAX_WAIT,
+    ):
+        self.limits = limits or ENDPOINT_LIMITS
+        self.max_concurrency = max_concurrency or os.cpu_count() or 1
+        self.max_wait = max_wait
+        self.running = 0
+        # cost units per second per job, EWMA over finished jobs
+        self.rate = INITIAL_RATE
+        self._queues: dict[str, _Queue] = {}
+        self._seq = itertools.count()
+
+    def _queue(self, endpoint: str) -> _Queue:
+        queue = self._queues.get(endpoint)
+        if queue is None:
+            queue = self._queues[endpoint] = _Queue(self.limits.get(endpoint) or self.limits['default'])
+        return queue
+
+    def estimated_wait(self, endpoint: str, cost: float = 0.0) -> float:
+        """Seconds until a job of ``cost`` queued now on ``endpoint`` would be done."""
+        queue = self._queue(endpoint)
+        slots = min(queue.limits.concurrency, self.max_concurrency)
+        return (queue.running_cost + queue.queued_cost + cost) / (self.rate * slots)
+
+    def _reject(self, wait: float, message: str):
+        raise ServiceUnavailable(message, retry_after=max(1, math.ceil(wait)))
+
+    def _start(self, queue: _Queue, cost: float):
+        queue.running += 1
+        queue.running_cost += cost
+        self.running += 1
+
+    def _finish(self, queue: _Queue, cost: float, elapsed: Optional[float]):
+        queue.running -= 1
+        queue.running_cost -= cost
+        self.running -= 1
+        if elapsed and elapsed > 0.001:
+            self.rate = 0.8 * self.rate + 0.2 * (cost / elapsed)
+        self._dispatch()
+
+    def _dispatch(self):
+        # fill free slots, oldest head first across endpoints
+        while self.running < self.max_concurrency:
+            best: Optional[tuple[_Queue, _Entry]] = None
+            for queue in self._queues.values():
+                if not queue.can_run():
+                    continue
+                entry = queue.head()
+                if entry is not None and (best is None or entry.seq < best[1].seq):
+                    best = queue, entry
+            if best is None:
+                return
+
+            queue, entry = best
+            heapq.heappop(queue.heap)
+            queue.waiting -= 1
+            queue.queued_cost -= entry.cost
+            queue.virtual_time = entry.tag
+            if len(queue.client_tags) > 1024:
+                queue.client_tags = {k: v for k, v in queue.client_tags.items() if v > queue.virtual_time}
+
+            self._start(queue, entry.cost)
+            future, entry.future = entry.future, None
+            future.set_result(None)  # type: ignore  # only live entries are at the head
+
+    @asynccontextmanager
+    async def admit(self, endpoint: str, client: str, cost: float) -> AsyncIterator[None]:
+        queue = self._queue(endpoint)
+
+        if queue.can_run() and self.running < self.max_concurrency and queue.head() is None:
+            self._start(queue, cost)
+        else:
+            if queue.waiting >= queue.limits.queue_depth:
+                self._reject(self.estimated_wait(endpoint), 'Too many queued requests, try again later.')
+            wait = self.estimated_wait(endpoint, cost)
+            if wait > self.max_wait:
+                self._reject(wait, 'Server is busy, try again later.')
+
+            start_tag = max(queue.virtual_time, queue.client_tags.get(client, 0.0))
+            queue.client_tags[client] = start_tag + cost
+            entry = _Entry(start_tag, next(self._seq), cost, asyncio.get_running_loop().create_future())
+            future = entry.future
+            heapq.heappush(queue.heap, entry)
+            queue.waiting += 1
+            queue.queued_cost += cost
+            try:
+                with span('queue'):
+                    await future  # type: ignore
+            except asyncio.CancelledError:
+                if entry.future is not None:
+                    # still queued, leave the slot for someone else
+                    entry.future = None
+                    queue.waiting -= 1
+                    queue.queued_cost -= cost
+                else:
+                    # dispatched while being cancelled, give the slot back
+                    self._finish(queue, cost, None)
+                raise
+
+        started = time.perf_counter()
+        try:
+            yield
+        finally:
+            self._finish(queue, cost, time.perf_counter() - started)
+
+
+def get_scheduler(app) -> Scheduler:
+    scheduler = app.state.scheduler
+    if not scheduler:
+        scheduler = Scheduler()
+        app.state.scheduler = scheduler
+    return scheduler
+
+
+def client_host(request: Request) -> str:
+    return request.client.host if request.client else '127.0.0.1'
+
+
+def admit(request: Request, endpoint: str, cost: float):
+    """``async with admit(request, 'sand', cost):`` around the work of a request."""
+    set_endpoint(endpoint)
+    return get_scheduler(request.app).admit(endpoint, client_host(request), cost)
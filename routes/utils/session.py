@@ -1,15 +1,86 @@
+from __future__ import annotations
+from typing import NamedTuple, Optional
 
 import aiohttp
 
 from ..errors import errors
+from .img_header import probe_header, count_frames
+from .metrics import span, add_bytes_in
 
 # 10MiB filesize limit
 MAX_FILESIZE = 10_485_760
 
+# download chunk size
+CHUNK_SIZE = 65_536
+
 # content type limits
 ACCEPTED_CONTENT_TYPE = {'image/png', 'image/gif', 'image/jpeg', 'image/jpg', 'image/webp'}
 
 
+class ImageLimits(NamedTuple):
+    # width * height of a single frame
+    max_pixels: int = 16_777_216
+    # None to skip the frame check, for endpoints that only use the first frame
+    max_frames: Optional[int] = None
+    # width * height * frames
+    max_total_pixels: Optional[int] = None
+    # height / width, for effects that scale the image to a fixed width
+    max_height_ratio: Optional[float] = None
+
+
+# per-endpoint decode budgets, checked against the image header before anything is decoded.
+# The salt effects scale to a fixed width, so their kernels grow with the height ratio, not
+# with the pixels: particles and dust are also capped at 600px and stay under ~128MB of
+# frames, sand pads both sides by a third of the height and runs height/2 + width/4 frames
+# (~250MB at 1:3), explode has no cap and keeps 75 frames and int grids per pixel of its
+# 80px wide grid.
+IMAGE_LIMITS: dict[str, ImageLimits] = {
+    'default': ImageLimits(),
+    'particles': ImageLimits(),
+    'explode': ImageLimits(max_height_ratio=16),
+    'dust': ImageLimits(),
+    'sand': ImageLimits(max_height_ratio=3),
+    'replace_colors': ImageLimits(max_pixels=8_388_608, max_frames=500, max_total_pixels=67_108_864),
+    'merge_source': ImageLimits(max_pixels=16_777_216),
+}
+
+
+def check_limits(data, limits: ImageLimits, *, complete: bool = True) -> bool:
+    """Raise PayloadTooLarge if the image in ``data`` is over budget.
+
+    With ``complete=False`` only the header is checked, an APNG frame count too once its
+    acTL has arrived. Returns whether the header checks are done, False while more of
+    the file is needed for them.
+    """
+    info = probe_header(data)
+    if info is None:
+        return False
+
+    pixels = info.width * info.height
+    if pixels > limits.max_pixels:
+        raise errors.PayloadTooLarge(
+            f'{info.width}x{info.height} image greater than max allowed size ({limits.max_pixels} pixels).'
+        )
+
+    if limits.max_height_ratio and info.height > info.width * limits.max_height_ratio:
+        raise errors.PayloadTooLarge(
+            f'{info.width}x{info.height} image taller than {limits.max_height_ratio} times its width.'
+        )
+
+    if limits.max_frames or limits.max_total_pixels:
+        frames = count_frames(data, info) if complete else info.frames
+        if frames is None:
+            # a PNG's acTL or first IDAT may still come, the other formats count when complete
+            return info.mime != 'image/png'
+        if limits.max_frames and frames > limits.max_frames:
+            raise errors.PayloadTooLarge(f'{frames} frames greater than max allowed frames ({limits.max_frames}).')
+        if limits.max_total_pixels and pixels * frames > limits.max_total_pixels:
+            raise errors.PayloadTooLarge(
+                f'{frames} frames of {info.width}x{info.height} greater than max allowed size.'
+            )
+    return True
+
+
 def get_session(app) -> aiohttp.ClientSession:
     session = app.state.session
     if not session:
@@ -25,7 +96,16 @@ async def close_sesssion(app):
     app.state.session = None
 
 
-async def get_image_url(app, url: str) -> bytes:
+async def get_image_url(app, url: str, *, limits: Optional[ImageLimits] = None) -> bytes:
+    limits = limits or IMAGE_LIMITS['default']
+    with span('fetch'):
+        data = await _download(app, url, limits)
+        add_bytes_in(len(data))
+        check_limits(data, limits)
+    return bytes(data)
+
+
+async def _download(app, url: str, limits: ImageLimits) -> bytearray:
     session = get_session(app)
     async with session.get(url) as resp:
         if resp.content_type not in ACCEPTED_CONTENT_TYPE:
@@ -35,4 +115,16 @@ async def get_image_url(app, url: str) -> bytes:
         if not resp.ok:
             raise errors.ZNeitizException(resp.status, f'Could not download URL: {resp.reason}')
 
-        return await resp.read()
+        # stream so a missing/lying Content-Length can't make us buffer more than MAX_FILESIZE,
+        # and so huge dimensions and APNG frame counts are rejected from the header before the
+        # rest is downloaded
+        data = bytearray()
+        header_checked = False
+        async for chunk in resp.content.iter_chunked(CHUNK_SIZE):
+            data += chunk
+            if len(data) > MAX_FILESIZE:
+                raise errors.PayloadTooLarge('URL content greater than max allowed filesize (10 MB).')
+            if not header_checked:
+                header_checked = check_limits(data, limits, complete=False)
+
+    return data